@@ -0,0 +1,254 @@
+// batch.h
+// Columnar evaluation of a program over many rows of variable values
+
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include "program.h"
+#include "bulk.h"
+#include "divide.h"
+
+#define BATCH_BLOCK 256 // rows evaluated together, small enough for a block of every stack slot to stay in cache
+
+typedef struct Columns {
+    size_t     rows;
+    uint32_t   bound;             // bit n is set if variable n has a column
+    long long *values[VARIABLES]; // rows values of each bound variable
+} Columns;
+
+void columns_init(Columns *columns, size_t rows) {
+    columns->rows = rows;
+    columns->bound = 0;
+    for(int v = 0; v < VARIABLES; v++) columns->values[v] = NULL;
+}
+
+// reads a column file: a header line naming the variables, then one line of values per row
+void columns_read(Columns *columns, const char *path) {
+    BulkInput input;
+    bulk_read(&input, path);
+    if(!input.count) die("%s has no header.\n", path);
+    columns_init(columns, input.count - 1);
+
+    int order[VARIABLES], ncolumns = 0;
+    for(size_t i = 0; i < input.lengths[0]; i++) {
+        char c = input.lines[0][i];
+        if(c == ' ' || c == '\t' || c == ',') continue;
+        if(c < 'a' || c > 'z' || columns->bound & 1u << (c - 'a')) die("Invalid column %c.\n", c);
+        columns->bound |= 1u << (c - 'a');
+        columns->values[c - 'a'] = malloc(sizeof(long long) * (columns->rows + 1));
+        order[ncolumns++] = c - 'a';
+    }
+
+    for(size_t row = 0; row < columns->rows; row++) {
+        char *c = input.lines[row + 1], *end = c + input.lengths[row + 1];
+        for(int i = 0; i < ncolumns; i++) {
+            while(c < end && (*c == ' ' || *c == '\t' || *c == ',')) c++;
+            char *next;
+            long long value = parse_number(c, &next);
+            if(next == c || next > end) die("Missing value in row %zu.\n", row + 1);
+            columns->values[order[i]][row] = value;
+            c = next;
+        }
+    }
+    bulk_input_free(&input);
+}
+
+void columns_free(Columns *columns) {
+    for(int v = 0; v < VARIABLES; v++) free(columns->values[v]);
+}
+
+// dies naming the first row of the block whose division fails
+void batch_division_error(const long long *a, const long long *b, size_t n, size_t base) {
+    for(size_t r = 0; r < n; r++) {
+        if(b[r] == 0) die("Division by zero in row %zu.\n", base + r + 1);
+        if(b[r] == -1 && a[r] == LLONG_MIN) die("Division overflow in row %zu.\n", base + r + 1);
+    }
+}
+
+// evaluates the program for rows begin to end, instruction by instruction over blocks of rows,
+// so each operator is a tight loop the compiler can vectorize. results go to out[begin..end).
+// scratch holds at least program->depth * BATCH_BLOCK values
+void program_eval_rows(const Program *program, Columns *columns, size_t begin, size_t end, long long *out,
+                       long long *scratch, DivisorCache *divisors) {
+    program_check_bindings(program, columns->bound);
+    if(program_profiler) program_profiler(program->code, program->length, 1, end - begin);
+    uint64_t start = phase_start();
+
+    for(size_t base = begin; base < end; base += BATCH_BLOCK) {
+        size_t n = end - base < BATCH_BLOCK ? end - base : BATCH_BLOCK;
+        long long *top = scratch; // next free stack slot
+
+        for(size_t i = 0; i < program->length; i++) {
+            long long *a = top - 2 * BATCH_BLOCK, *b = top - BATCH_BLOCK;
+            long long arg = program->args[i];
+
+            switch(program->code[i]) {
+                case OP_PUSH:
+                    for(size_t r = 0; r < n; r++) top[r] = arg;
+                    top += BATCH_BLOCK;
+                    break;
+
+                case OP_VAR:
+                    memcpy(top, columns->values[arg] + base, sizeof(*top) * n);
+                    top += BATCH_BLOCK;
+                    break;
+
+                case OP_ADD: for(size_t r = 0; r < n; r++) a[r] += b[r]; top = b; break;
+                case OP_SUB: for(size_t r = 0; r < n; r++) a[r] -= b[r]; top = b; break;
+                case OP_MUL: for(size_t r = 0; r < n; r++) a[r] *= b[r]; top = b; break;
+                case OP_EXP: for(size_t r = 0; r < n; r++) a[r] = powl(a[r], b[r]); top = b; break;
+                case OP_NEG: for(size_t r = 0; r < n; r++) b[r] = -b[r]; break;
+                case OP_SHL: for(size_t r = 0; r < n; r++) b[r] = op_shl(b[r], arg); break;
+                case OP_SQUARE: for(size_t r = 0; r < n; r++) b[r] = op_square(b[r]); break;
+
+                case OP_DADD: decimal_block(decimal_add, a, a, b, n, base); top = b; break;
+                case OP_DSUB: decimal_block(decimal_sub, a, a, b, n, base); top = b; break;
+                case OP_DMUL: decimal_block(decimal_mul, a, a, b, n, base); top = b; break;
+                case OP_DDIV: decimal_block(decimal_div, a, a, b, n, base); top = b; break;
+                case OP_DEXP: decimal_block(decimal_pow, a, a, b, n, base); top = b; break;
+                case OP_DNEG: decimal_block(decimal_neg, b, b, b, n, base); break;
+
+                case OP_MVAR:
+                    for(size_t r = 0; r < n; r++) top[r] = mont_in(columns->values[arg][base + r], &modulus);
+                    top += BATCH_BLOCK;
+                    break;
+
+                case OP_MADD: modular_block(mod_add, a, a, b, n, base); top = b; break;
+                case OP_MSUB: modular_block(mod_sub, a, a, b, n, base); top = b; break;
+                case OP_MMUL: modular_block(mod_mul, a, a, b, n, base); top = b; break;
+                case OP_MDIV: modular_block(mod_div, a, a, b, n, base); top = b; break;
+                case OP_MEXP: modular_block(mod_pow, a, a, b, n, base); top = b; break;
+                case OP_MNEG: modular_block(mod_neg, b, b, b, n, base); break;
+                case OP_MOUT: for(size_t r = 0; r < n; r++) b[r] = mont_out(b[r], &modulus); break;
+
+                case OP_PUSH_ADD: for(size_t r = 0; r < n; r++) b[r] += arg; break;
+                case OP_PUSH_SUB: for(size_t r = 0; r < n; r++) b[r] -= arg; break;
+                case OP_PUSH_MUL: for(size_t r = 0; r < n; r++) b[r] *= arg; break;
+                case OP_VAR_ADD: for(size_t r = 0; r < n; r++) b[r] += columns->values[arg][base + r]; break;
+                case OP_VAR_SUB: for(size_t r = 0; r < n; r++) b[r] -= columns->values[arg][base + r]; break;
+                case OP_VAR_MUL: for(size_t r = 0; r < n; r++) b[r] *= columns->values[arg][base + r]; break;
+
+                case OP_VAR_VAR_ADD:
+                case OP_VAR_VAR_SUB:
+                case OP_VAR_VAR_MUL: {
+                    const long long *x = columns->values[arg & 0xff] + base, *y = columns->values[arg >> 8] + base;
+                    if(program->code[i] == OP_VAR_VAR_ADD) for(size_t r = 0; r < n; r++) top[r] = x[r] + y[r];
+                    else if(program->code[i] == OP_VAR_VAR_SUB) for(size_t r = 0; r < n; r++) top[r] = x[r] - y[r];
+                    else for(size_t r = 0; r < n; r++) top[r] = x[r] * y[r];
+                    top += BATCH_BLOCK;
+                    break;
+                }
+
+                case OP_DIV:
+                    if(!divide_block(a, a, b, n, divisors)) batch_division_error(a, b, n, base);
+                    top = b;
+                    break;
+
+                default: die("Unknown opcode.\n");
+            }
+        }
+
+        memcpy(out + base, scratch, sizeof(*out) * n);
+    }
+    phase_mark(PHASE_EVAL, start); // not reached when a row dies, like every phase
+}
+
+// evaluates the program for every row, scratch holds at least program->depth * BATCH_BLOCK values
+void program_eval_batch(const Program *program, Columns *columns, long long *out, long long *scratch) {
+    DivisorCache divisors;
+    divisor_cache_init(&divisors);
+    program_eval_rows(program, columns, 0, columns->rows, out, scratch, &divisors);
+}
+
+// what a thread needs to evaluate programs: compiled programs are never written during
+// evaluation, so any number of threads can evaluate the same one at once, each with a context
+typedef struct EvalContext {
+    long long   *stack; // values of program_eval or blocks of program_eval_rows
+    size_t       size;
+    DivisorCache divisors;
+} EvalContext;
+
+void eval_context_init(EvalContext *ctx) {
+    ctx->stack = NULL;
+    ctx->size = 0;
+    divisor_cache_init(&ctx->divisors);
+}
+
+void eval_context_free(EvalContext *ctx) {
+    free(ctx->stack);
+}
+
+long long *eval_context_stack(EvalContext *ctx, size_t size) {
+    if(ctx->size < size) {
+        ctx->size = size;
+        ctx->stack = realloc(ctx->stack, sizeof(*ctx->stack) * size);
+    }
+    return ctx->stack;
+}
+
+long long program_run(const Program *program, EvalContext *ctx, const long long *vars) {
+    return program_eval(program, eval_context_stack(ctx, program->depth), vars);
+}
+
+void program_run_rows(const Program *program, EvalContext *ctx, Columns *columns, size_t begin, size_t end, long long *out) {
+    long long *scratch = eval_context_stack(ctx, program->depth * BATCH_BLOCK);
+    program_eval_rows(program, columns, begin, end, out, scratch, &ctx->divisors);
+}
+
+// rows of the column file evaluated by one thread of program_eval_parallel
+typedef struct BatchWorker {
+    pthread_t      thread;
+    const Program *program;
+    Columns       *columns;
+    size_t         begin, end;
+    long long     *out;
+    bool           failed;
+    char           error[sizeof(die_message)];
+} BatchWorker;
+
+void *batch_worker(void *arg) {
+    BatchWorker *worker = arg;
+    EvalContext ctx;
+    eval_context_init(&ctx);
+
+    jmp_buf jump;
+    die_jump = &jump;
+    if(!setjmp(jump)) {
+        program_run_rows(worker->program, &ctx, worker->columns, worker->begin, worker->end, worker->out);
+    } else {
+        worker->failed = true;
+        strcpy(worker->error, die_message);
+    }
+    die_jump = NULL;
+    eval_context_free(&ctx);
+    return NULL;
+}
+
+// evaluates the one program for every row with the rows split between threads.
+// each thread stops at its first error, the one of the earliest rows is reported
+void program_eval_parallel(const Program *program, Columns *columns, long long *out, int threads) {
+    size_t blocks = (columns->rows + BATCH_BLOCK - 1) / BATCH_BLOCK;
+    if(threads > (int)blocks) threads = blocks;
+    if(threads <= 1) {
+        long long *scratch = malloc(sizeof(*scratch) * (program->depth * BATCH_BLOCK + 1));
+        program_eval_batch(program, columns, out, scratch);
+        free(scratch);
+        return;
+    }
+
+    BatchWorker *workers = calloc(threads, sizeof(*workers));
+    for(int t = 0; t < threads; t++) {
+        BatchWorker *worker = &workers[t];
+        *worker = (BatchWorker){ .program = program, .columns = columns, .out = out };
+        worker->begin = blocks * t / threads * BATCH_BLOCK;
+        worker->end = t + 1 < threads ? blocks * (t + 1) / threads * BATCH_BLOCK : columns->rows;
+        pthread_create(&worker->thread, NULL, batch_worker, worker);
+    }
+    for(int t = 0; t < threads; t++) pthread_join(workers[t].thread, NULL);
+    for(int t = 0; t < threads; t++) {
+        if(workers[t].failed) die("%s", workers[t].error);
+    }
+    free(workers);
+}
+
+#endif // _BATCH_H
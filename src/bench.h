@@ -0,0 +1,120 @@
+// bench.h
+// Generated expressions of different shapes and timing of the front ends over them
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include "shunting.h"
+#include "pratt.h"
+#include "bulk.h"
+#include "counters.h"
+#include "generate.h"
+
+#define BENCH_CHUNK 64 // queues built ahead of a timed loop, a conversion empties its input
+
+// writes an expression of about n tokens into text, which holds at least 4 * n + 16 characters
+typedef void (*Workload)(char *text, size_t n);
+
+// long chain of mixed precedence left associative operators: 1+2*3-4/5+...
+void workload_flat(char *text, size_t n) {
+    static const char ops[] = "+*-/";
+    char *c = text;
+    *c++ = '1';
+    for(size_t i = 1; i < n / 2; i++) {
+        *c++ = ops[i % 4];
+        *c++ = '1' + i % 9;
+    }
+    *c = 0;
+}
+
+// deeply nested groups: ((((1+2)*3)-4)/5)...
+void workload_nested(char *text, size_t n) {
+    static const char ops[] = "+*-/";
+    size_t groups = n / 4;
+    char *c = text;
+    memset(c, '(', groups);
+    c += groups;
+    *c++ = '1';
+    for(size_t i = 0; i < groups; i++) {
+        *c++ = ops[i % 4];
+        *c++ = '1' + (i + 1) % 9;
+        *c++ = ')';
+    }
+    *c = 0;
+}
+
+// right associative chain: 2^2^2^...
+void workload_right(char *text, size_t n) {
+    char *c = text;
+    *c++ = '2';
+    for(size_t i = 1; i < n / 2; i++) {
+        *c++ = '^';
+        *c++ = '2';
+    }
+    *c = 0;
+}
+
+// random expressions from a fixed seed: mixed operators, negation and nesting. numbers have
+// at most two digits so the text stays within 4 * n + 16 with the generator's slack
+void workload_random(char *text, size_t n) {
+    GenerateConfig config = GENERATE_DEFAULTS;
+    config.min_tokens = config.max_tokens = n;
+    config.max_depth = 16;
+    config.max_width = 2;
+    Generator generator;
+    generator_init(&generator, &config, 1);
+    generate_expression(&generator, text);
+}
+
+typedef struct Shape {
+    const char *name;
+    Workload    generate;
+} Shape;
+
+static const Shape SHAPES[] = {
+    { "flat",   workload_flat   },
+    { "nested", workload_nested },
+    { "right",  workload_right  },
+    { "random", workload_random },
+};
+
+#define SHAPE_COUNT (sizeof(SHAPES) / sizeof(*SHAPES))
+
+// times lexing the text, or converting it with the front end if there is one, into queues or
+// buffers. returns the seconds per repetition, counters may be NULL
+double bench_phase(const FrontEnd *fe, bool queues, char *text, TokenBuffer *input, size_t repeat, PerfCounters *counters) {
+    static TokenQueue in[BENCH_CHUNK], out[BENCH_CHUNK];
+    TokenBuffer output;
+    token_buffer_init(&output);
+
+    double elapsed = 0;
+    for(size_t done = 0; done < repeat; done += BENCH_CHUNK) {
+        size_t n = repeat - done < BENCH_CHUNK ? repeat - done : BENCH_CHUNK;
+        for(size_t i = 0; i < n && queues; i++) {
+            queue_init(&in[i]);
+            queue_init(&out[i]);
+            if(fe) read_input(&in[i], text);
+        }
+
+        double start = bulk_now();
+        if(counters) perf_counters_start(counters);
+        for(size_t i = 0; i < n; i++) {
+            output.length = 0;
+            if(queues && fe) fe->convert(&in[i], &out[i]);
+            else if(queues)  read_input(&out[i], text);
+            else if(fe)      fe->convert_buffer(input, &output);
+            else             read_input_buffer(&output, text);
+        }
+        if(counters) perf_counters_stop(counters);
+        elapsed += bulk_now() - start;
+
+        for(size_t i = 0; i < n && queues; i++) {
+            queue_free(&in[i]);
+            queue_free(&out[i]);
+        }
+    }
+    token_buffer_free(&output);
+    return elapsed / repeat;
+}
+
+#endif // _BENCH_H
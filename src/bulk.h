@@ -0,0 +1,439 @@
+// bulk.h
+// Work-stealing scheduler for processing files of newline-separated expressions
+// with optional NUMA-aware placement of workers and input
+
+#ifndef _BULK_H
+#define _BULK_H
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "shunting.h"
+#include "io.h"
+
+#define BULK_MAX_WORKERS 256
+#define BULK_MAX_NODES   16
+#define BULK_CHUNK_BYTES 4096 // target amount of input text per chunk
+
+typedef struct BulkInput {
+    char   *data;    // private mapping or copy of the file, lines are null-terminated by the workers
+    char  **lines;   // start of each non-empty line
+    size_t *lengths; // length of each line
+    size_t *numbers; // line number of each line in the file, counting blank lines, from 1
+    size_t  count;   // number of lines
+    size_t  size;    // total size of the file
+    size_t  mapped;  // size of the mapping, 0 if the file was read into memory
+} BulkInput;
+
+// cpus of each NUMA node, detected from sysfs or simulated for testing
+typedef struct BulkTopology {
+    int nodes;
+    int ncpus[BULK_MAX_NODES];
+    int cpus[BULK_MAX_NODES][BULK_MAX_WORKERS];
+} BulkTopology;
+
+// a range of consecutive lines processed as one unit of work
+typedef struct BulkChunk {
+    size_t begin, end;
+} BulkChunk;
+
+// a worker's queue of chunks: the owner takes from the front, thieves steal from the back
+typedef struct BulkDeque {
+    pthread_mutex_t lock;
+    BulkChunk      *chunks; // allocated by the owner so that it lives on the owner's node
+    size_t          front, back;
+} BulkDeque;
+
+// a cache line each, so workers updating their own don't invalidate each other's
+typedef struct __attribute__((aligned(64))) BulkWorkerStats {
+    int    node;   // NUMA node the worker was placed on
+    int    cpu;    // cpu the worker is pinned to or -1
+    size_t chunks; // chunks processed
+    size_t stolen; // of which stolen from other workers
+    size_t remote; // of which stolen from workers on other nodes
+    size_t lines;  // expressions processed
+    size_t bytes;  // input text processed
+    double busy;   // seconds spent processing chunks
+} BulkWorkerStats;
+
+typedef struct BulkStats {
+    int             workers;
+    double          wall; // seconds from start to the last worker finishing
+    BulkWorkerStats worker[BULK_MAX_WORKERS];
+} BulkStats;
+
+// called once for every line, possibly from several threads at once
+typedef void (*BulkFunc)(void *ctx, size_t index, char *line);
+
+typedef struct BulkRun BulkRun;
+
+typedef struct BulkWorker {
+    BulkRun  *run;
+    int       id;
+    int       node;
+    int       cpu;   // cpu to pin to or -1
+    BulkChunk seed;  // chunks [begin, end) this worker starts with
+} BulkWorker;
+
+struct BulkRun {
+    BulkInput        *input;
+    BulkFunc          func;
+    void             *ctx;
+    int               workers;
+    BulkChunk        *chunks;
+    BulkDeque         deque[BULK_MAX_WORKERS];
+    BulkWorker        worker[BULK_MAX_WORKERS];
+    BulkStats        *stats;
+    pthread_barrier_t ready; // all deques are filled
+};
+
+double bulk_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// returns the number of online processors
+int bulk_default_workers() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if(n < 1) return 1;
+    if(n > BULK_MAX_WORKERS) return BULK_MAX_WORKERS;
+    return n;
+}
+
+// tells command line options apart from expressions starting with a unary minus
+bool is_flag(const char *arg) {
+    return arg[0] == '-' && (isalpha(arg[1]) || arg[1] == '-');
+}
+
+// parses a cpu list like "0-3,8,10-11", returns the number of cpus stored
+int bulk_parse_cpulist(const char *list, int *cpus, int max) {
+    int n = 0;
+    while(*list) {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if(end == list) die("Invalid cpu list.\n");
+        if(*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if(end == list || last < first) die("Invalid cpu list.\n");
+        }
+        for(long cpu = first; cpu <= last && n < max; cpu++) cpus[n++] = cpu;
+        list = end;
+        if(*list == ',') list++;
+        else if(*list && *list != '\n') die("Invalid cpu list.\n");
+        else break;
+    }
+    return n;
+}
+
+// simulates a topology given as cpu lists of each node separated by slashes, e.g. "0-3/4-7"
+void bulk_topology_parse(BulkTopology *topology, const char *spec) {
+    topology->nodes = 0;
+    char buffer[4096];
+    strncpy(buffer, spec, sizeof(buffer) - 1);
+    buffer[sizeof(buffer) - 1] = 0;
+
+    for(char *save, *list = strtok_r(buffer, "/", &save); list; list = strtok_r(NULL, "/", &save)) {
+        if(topology->nodes == BULK_MAX_NODES) die("Too many nodes.\n");
+        int node = topology->nodes++;
+        topology->ncpus[node] = bulk_parse_cpulist(list, topology->cpus[node], BULK_MAX_WORKERS);
+        if(!topology->ncpus[node]) die("Node %d has no cpus.\n", node);
+    }
+    if(!topology->nodes) die("Empty topology.\n");
+}
+
+// reads the node layout from sysfs, falls back to a single node with all online cpus
+void bulk_topology_detect(BulkTopology *topology) {
+    topology->nodes = 0;
+    for(int node = 0; node < BULK_MAX_NODES; node++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if(!f) continue;
+        if(fgets(list, sizeof(list), f) && list[0] != '\n') {
+            int n = topology->nodes;
+            topology->ncpus[n] = bulk_parse_cpulist(list, topology->cpus[n], BULK_MAX_WORKERS);
+            if(topology->ncpus[n]) topology->nodes++;
+        }
+        fclose(f);
+    }
+
+    if(!topology->nodes) {
+        topology->nodes = 1;
+        topology->ncpus[0] = bulk_default_workers();
+        for(int i = 0; i < topology->ncpus[0]; i++) topology->cpus[0][i] = i;
+    }
+}
+
+// maps the file privately, followed by a zero byte
+void bulk_map(BulkInput *input, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) die("Cannot open %s.\n", path);
+
+    struct stat st;
+    if(fstat(fd, &st)) die("Cannot read %s.\n", path);
+    input->size = st.st_size;
+
+    // reserve one byte more than the file so that the last line can always be terminated,
+    // the part past the end of the file stays anonymous zeroed memory
+    input->mapped = input->size + 1;
+    input->data = mmap(NULL, input->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(input->data == MAP_FAILED) die("Cannot map %s.\n", path);
+    if(input->size && mmap(input->data, input->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        die("Cannot map %s.\n", path);
+    }
+    close(fd);
+}
+
+// splits the data into lines, skipping empty ones
+void bulk_split(BulkInput *input) {
+    size_t cap = 1024;
+    input->lines = malloc(sizeof(*input->lines) * cap);
+    input->lengths = malloc(sizeof(*input->lengths) * cap);
+    input->numbers = malloc(sizeof(*input->numbers) * cap);
+    input->count = 0;
+
+    char *c = input->data, *end = input->data + input->size;
+    for(size_t number = 1; c < end; number++) {
+        char *nl = memchr(c, '\n', end - c);
+        if(!nl) nl = end;
+
+        size_t length = nl - c;
+        if(length && c[length - 1] == '\r') length--;
+
+        if(length) {
+            if(input->count == cap) {
+                cap *= 2;
+                input->lines = realloc(input->lines, sizeof(*input->lines) * cap);
+                input->lengths = realloc(input->lengths, sizeof(*input->lengths) * cap);
+                input->numbers = realloc(input->numbers, sizeof(*input->numbers) * cap);
+            }
+            input->lines[input->count] = c;
+            input->lengths[input->count] = length;
+            input->numbers[input->count] = number;
+            input->count++;
+        }
+        c = nl + 1;
+    }
+}
+
+// maps the file, or reads it when io_uring is in use, and splits it into lines.
+// the mapping is private and only read here, pages get copied to the node of whichever
+// worker first null-terminates a line on them. a file read with io_uring is all on the
+// node of the calling thread, so use bulk_read_mapped for NUMA placement
+void bulk_read(BulkInput *input, const char *path) {
+    if(io_ring) {
+        // one spare zero byte so the last line can always be terminated
+        input->data = io_read_file(path, &input->size, 1);
+        input->mapped = 0;
+    } else {
+        bulk_map(input, path);
+    }
+    bulk_split(input);
+}
+
+// like bulk_read, but maps the file even when io_uring is in use
+void bulk_read_mapped(BulkInput *input, const char *path) {
+    bulk_map(input, path);
+    bulk_split(input);
+}
+
+void bulk_input_free(BulkInput *input) {
+    if(input->mapped) munmap(input->data, input->mapped);
+    else free(input->data);
+    free(input->lines);
+    free(input->lengths);
+    free(input->numbers);
+}
+
+// takes a chunk from the front of the worker's own deque
+bool bulk_pop(BulkDeque *deque, BulkChunk *chunk) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->front < deque->back) {
+        *chunk = deque->chunks[deque->front++];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// steals a chunk from the back of another worker's deque
+bool bulk_steal(BulkDeque *deque, BulkChunk *chunk) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->front < deque->back) {
+        *chunk = deque->chunks[--deque->back];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+void *bulk_worker(void *arg) {
+    BulkWorker *self = arg;
+    BulkRun *run = self->run;
+    BulkWorkerStats *stats = &run->stats->worker[self->id];
+    BulkInput *input = run->input;
+
+    stats->node = self->node;
+    stats->cpu = -1;
+    if(self->cpu >= 0) {
+        // pinning to a cpu that only exists in a simulated topology fails, the worker then just floats
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(self->cpu, &set);
+        if(!pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) stats->cpu = self->cpu;
+    }
+
+    // fill our own deque from here so that first touch puts it on our node
+    BulkDeque *own = &run->deque[self->id];
+    size_t seeded = self->seed.end - self->seed.begin;
+    own->chunks = malloc(sizeof(*own->chunks) * (seeded + 1));
+    memcpy(own->chunks, run->chunks + self->seed.begin, sizeof(*own->chunks) * seeded);
+    own->front = 0;
+    own->back = seeded;
+    pthread_barrier_wait(&run->ready);
+
+    BulkChunk chunk;
+    for(;;) {
+        bool stolen = false, remote = false;
+        if(!bulk_pop(own, &chunk)) {
+            // own deque is empty, go round the other workers on our node starting with the next one,
+            // then the remote ones. no work is ever added after the start, so finding nothing
+            // anywhere means we're done
+            for(int pass = 0; pass < 2 && !stolen; pass++) {
+                for(int i = 1; i < run->workers && !stolen; i++) {
+                    BulkWorker *victim = &run->worker[(self->id + i) % run->workers];
+                    if((victim->node != self->node) != pass) continue;
+                    stolen = bulk_steal(&run->deque[victim->id], &chunk);
+                    remote = pass;
+                }
+            }
+            if(!stolen) break;
+        }
+
+        double start = bulk_now();
+        size_t bytes = 0;
+        for(size_t i = chunk.begin; i < chunk.end; i++) {
+            input->lines[i][input->lengths[i]] = 0;
+            run->func(run->ctx, i, input->lines[i]);
+            bytes += input->lengths[i];
+        }
+        stats->bytes += bytes;
+        stats->busy += bulk_now() - start;
+        stats->lines += chunk.end - chunk.begin;
+        stats->chunks++;
+        if(stolen) stats->stolen++;
+        if(remote) stats->remote++;
+    }
+
+    return NULL;
+}
+
+// calls func for every line of the input on the given number of worker threads.
+// lines are grouped into chunks of roughly BULK_CHUNK_BYTES of text, so short expressions are
+// batched together while a long one makes up a chunk on its own. each worker starts with
+// a contiguous share of the text and steals chunks from the others once it runs out.
+// with a topology, workers are spread evenly over the nodes and pinned to their cpus,
+// so every node works on one contiguous part of the file and steals locally first.
+// without one, workers are left to the scheduler
+void bulk_run(BulkInput *input, int workers, BulkTopology *topology, BulkFunc func, void *ctx, BulkStats *stats) {
+    if(workers < 1) workers = 1;
+    if(workers > BULK_MAX_WORKERS) workers = BULK_MAX_WORKERS;
+
+    BulkRun *run = malloc(sizeof(*run));
+    run->input = input;
+    run->func = func;
+    run->ctx = ctx;
+    run->workers = workers;
+    run->stats = stats;
+    memset(stats, 0, sizeof(*stats));
+    stats->workers = workers;
+
+    // cut the input into chunks
+    BulkChunk *chunks = malloc(sizeof(*chunks) * (input->count + 1));
+    size_t nchunks = 0;
+    for(size_t i = 0; i < input->count;) {
+        size_t bytes = 0;
+        chunks[nchunks].begin = i;
+        while(i < input->count && (bytes == 0 || bytes + input->lengths[i] <= BULK_CHUNK_BYTES)) {
+            bytes += input->lengths[i++];
+        }
+        chunks[nchunks++].end = i;
+    }
+
+    run->chunks = chunks;
+
+    // hand out runs of chunks with roughly equal amounts of text,
+    // consecutive workers share a node so each node gets a contiguous part of the file
+    size_t next = 0, done = 0;
+    for(int w = 0; w < workers; w++) {
+        BulkWorker *worker = &run->worker[w];
+        worker->run = run;
+        worker->id = w;
+        worker->node = 0;
+        worker->cpu = -1;
+        if(topology) {
+            worker->node = w * topology->nodes / workers;
+            int first = (worker->node * workers + topology->nodes - 1) / topology->nodes; // first worker on the node
+            worker->cpu = topology->cpus[worker->node][(w - first) % topology->ncpus[worker->node]];
+        }
+
+        size_t share = (input->size - done) / (workers - w);
+        size_t taken = 0;
+        worker->seed.begin = next;
+        while(next < nchunks && (taken < share || w == workers - 1)) {
+            for(size_t i = chunks[next].begin; i < chunks[next].end; i++) taken += input->lengths[i];
+            next++;
+        }
+        worker->seed.end = next;
+        done += taken;
+
+        pthread_mutex_init(&run->deque[w].lock, NULL);
+    }
+    pthread_barrier_init(&run->ready, NULL, workers);
+
+    double start = bulk_now();
+    pthread_t threads[BULK_MAX_WORKERS];
+    for(int w = 0; w < workers; w++) {
+        if(pthread_create(&threads[w], NULL, bulk_worker, &run->worker[w])) die("Cannot create worker thread.\n");
+    }
+    for(int w = 0; w < workers; w++) pthread_join(threads[w], NULL);
+    stats->wall = bulk_now() - start;
+
+    for(int w = 0; w < workers; w++) {
+        pthread_mutex_destroy(&run->deque[w].lock);
+        free(run->deque[w].chunks);
+    }
+    pthread_barrier_destroy(&run->ready);
+    free(chunks);
+    free(run);
+}
+
+// prints per-worker utilization
+void bulk_print_stats(BulkStats *stats, FILE *f) {
+    fprintf(f, "worker node  cpu   chunks   stolen   remote      lines        bytes    busy  util\n");
+    double busy = 0;
+    for(int w = 0; w < stats->workers; w++) {
+        BulkWorkerStats *s = &stats->worker[w];
+        char cpu[16] = "-";
+        if(s->cpu >= 0) snprintf(cpu, sizeof(cpu), "%d", s->cpu);
+        fprintf(f, "%6d %4d %4s %8zu %8zu %8zu %10zu %12zu %6.3fs %4.0f%%\n", w, s->node, cpu,
+            s->chunks, s->stolen, s->remote, s->lines, s->bytes, s->busy,
+            stats->wall > 0 ? 100 * s->busy / stats->wall : 0);
+        busy += s->busy;
+    }
+    fprintf(f, "wall %.3fs, utilization %.0f%%\n", stats->wall,
+        stats->wall > 0 ? 100 * busy / (stats->wall * stats->workers) : 0);
+}
+
+#endif // _BULK_H
@@ -0,0 +1,145 @@
+// cache.h
+// Cache of compiled programs keyed by expression text with least-recently-used eviction
+//
+// a pinned entry is never evicted, so a caller can hold on to its program across other puts.
+// when every entry is pinned the cache grows past its capacity until some are unpinned
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <string.h>
+#include <stddef.h>
+#include "program.h"
+
+typedef struct CacheEntry CacheEntry;
+struct CacheEntry {
+    char       *text;   // expression, null-terminated
+    size_t      length;
+    uint64_t    hash;
+    Program     program;
+    unsigned    pins;   // holders of the program, evicted only at 0
+    CacheEntry *chain;  // next entry in the same bucket
+    CacheEntry *newer;  // recency list
+    CacheEntry *older;
+};
+
+typedef struct Cache {
+    CacheEntry **buckets;
+    size_t       nbuckets; // power of two
+    size_t       count;
+    size_t       capacity; // maximum number of entries
+    CacheEntry  *newest;
+    CacheEntry  *oldest;
+    size_t       hits, misses, evictions;
+} Cache;
+
+// FNV-1a
+uint64_t hash_text(const char *text, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for(size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)text[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void cache_init(Cache *cache, size_t capacity) {
+    if(capacity < 1) capacity = 1;
+    cache->nbuckets = 16;
+    while(cache->nbuckets < capacity) cache->nbuckets *= 2;
+    cache->buckets = calloc(cache->nbuckets, sizeof(*cache->buckets));
+    cache->count = 0;
+    cache->capacity = capacity;
+    cache->newest = cache->oldest = NULL;
+    cache->hits = cache->misses = cache->evictions = 0;
+}
+
+void cache_unlink(Cache *cache, CacheEntry *entry) {
+    if(entry->newer) entry->newer->older = entry->older;
+    else cache->newest = entry->older;
+    if(entry->older) entry->older->newer = entry->newer;
+    else cache->oldest = entry->newer;
+}
+
+void cache_link_newest(Cache *cache, CacheEntry *entry) {
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if(cache->newest) cache->newest->newer = entry;
+    else cache->oldest = entry;
+    cache->newest = entry;
+}
+
+void cache_remove(Cache *cache, CacheEntry *entry) {
+    cache_unlink(cache, entry);
+
+    CacheEntry **link = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    while(*link != entry) link = &(*link)->chain;
+    *link = entry->chain;
+
+    program_free(&entry->program);
+    free(entry->text);
+    free(entry);
+    cache->count--;
+}
+
+// removes the least recently used entry that isn't pinned, false if there is none
+bool cache_evict(Cache *cache) {
+    CacheEntry *entry = cache->oldest;
+    while(entry && entry->pins) entry = entry->newer;
+    if(!entry) return false;
+    cache_remove(cache, entry);
+    cache->evictions++;
+    return true;
+}
+
+// keeps the cached program from being evicted until it's unpinned as many times
+void cache_pin(Program *program) {
+    ((CacheEntry *)((char *)program - offsetof(CacheEntry, program)))->pins++;
+}
+
+void cache_unpin(Program *program) {
+    ((CacheEntry *)((char *)program - offsetof(CacheEntry, program)))->pins--;
+}
+
+// returns the compiled program for the expression or NULL if it's not cached
+Program *cache_get(Cache *cache, const char *text, size_t length) {
+    uint64_t hash = hash_text(text, length);
+    for(CacheEntry *e = cache->buckets[hash & (cache->nbuckets - 1)]; e; e = e->chain) {
+        if(e->hash == hash && e->length == length && !memcmp(e->text, text, length)) {
+            cache_unlink(cache, e);
+            cache_link_newest(cache, e);
+            cache->hits++;
+            return &e->program;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+// takes ownership of the program and returns a pointer to the cached copy
+Program *cache_put(Cache *cache, const char *text, size_t length, Program *program) {
+    while(cache->count >= cache->capacity && cache_evict(cache));
+
+    CacheEntry *entry = malloc(sizeof(*entry));
+    entry->text = malloc(length + 1);
+    memcpy(entry->text, text, length);
+    entry->text[length] = 0;
+    entry->length = length;
+    entry->hash = hash_text(text, length);
+    entry->program = *program;
+    entry->pins = 0;
+
+    CacheEntry **bucket = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    entry->chain = *bucket;
+    *bucket = entry;
+    cache_link_newest(cache, entry);
+    cache->count++;
+    return &entry->program;
+}
+
+void cache_free(Cache *cache) {
+    while(cache->count) cache_remove(cache, cache->oldest);
+    free(cache->buckets);
+}
+
+#endif // _CACHE_H
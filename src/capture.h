@@ -0,0 +1,155 @@
+// capture.h
+// Compact binary log of evaluation requests, for replaying real traffic
+//
+// the log is a header followed by one record per request: the nanoseconds since the
+// previous request and the length of the request body as LEB128 varints, then the body as
+// the protocol sends it, bindings and expression text. a log cut off in the middle of a
+// record, e.g. by a crash, reads up to the last complete one
+
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "protocol.h"
+
+#define CAPTURE_MAGIC   "SHUNTCAP"
+#define CAPTURE_VERSION 1
+
+typedef struct CaptureHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t started; // wall clock ns since the epoch of the first request
+} CaptureHeader;
+
+typedef struct Capture {
+    FILE    *file;
+    uint64_t last;    // monotonic ns of the previous request, 0 before the first
+    size_t   records;
+    size_t   bytes;
+} Capture;
+
+uint64_t capture_clock(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void capture_open(Capture *capture, const char *path) {
+    capture->file = fopen(path, "wb");
+    if(!capture->file) die("Cannot open %s.\n", path);
+    setvbuf(capture->file, NULL, _IOFBF, 1 << 20);
+    capture->last = 0;
+    capture->records = 0;
+    capture->bytes = 0;
+}
+
+size_t capture_put_varint(uint8_t *p, uint64_t value) {
+    size_t n = 0;
+    while(value >= 0x80) {
+        p[n++] = value | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+// appends a request body, the header goes in with the first one so it knows when that came
+void capture_record(Capture *capture, const uint8_t *body, size_t n) {
+    uint64_t now = capture_clock(CLOCK_MONOTONIC);
+    if(!capture->last) {
+        CaptureHeader header = { .version = CAPTURE_VERSION, .started = capture_clock(CLOCK_REALTIME) };
+        memcpy(header.magic, CAPTURE_MAGIC, 8);
+        fwrite(&header, sizeof(header), 1, capture->file);
+        capture->last = now;
+        capture->bytes += sizeof(header);
+    }
+
+    uint8_t prefix[20];
+    size_t length = capture_put_varint(prefix, now - capture->last);
+    length += capture_put_varint(prefix + length, n);
+    fwrite(prefix, length, 1, capture->file);
+    fwrite(body, n, 1, capture->file);
+    capture->last = now;
+    capture->records++;
+    capture->bytes += length + n;
+}
+
+void capture_close(Capture *capture) {
+    if(fclose(capture->file)) die("Cannot write the capture.\n");
+}
+
+void capture_print_stats(Capture *capture, FILE *file) {
+    fprintf(file, "captured: %zu requests, %zu bytes\n", capture->records, capture->bytes);
+}
+
+// reads a log in place
+typedef struct CaptureReader {
+    uint8_t       *map;
+    size_t         size;
+    size_t         offset;
+    CaptureHeader *header;
+    bool           truncated; // the log ended in the middle of a record
+} CaptureReader;
+
+void capture_reader_open(CaptureReader *reader, const char *path) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) die("Cannot open %s.\n", path);
+    struct stat st;
+    if(fstat(fd, &st)) die("Cannot read %s.\n", path);
+    reader->size = st.st_size;
+    reader->offset = sizeof(CaptureHeader);
+    reader->truncated = false;
+    if(reader->size < sizeof(CaptureHeader)) {
+        // an empty log, nothing was captured
+        if(reader->size) die("%s is not a capture.\n", path);
+        reader->map = NULL;
+        reader->header = NULL;
+        close(fd);
+        return;
+    }
+    reader->map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(reader->map == MAP_FAILED) die("Cannot map %s.\n", path);
+    reader->header = (CaptureHeader *)reader->map;
+    if(memcmp(reader->header->magic, CAPTURE_MAGIC, 8)) die("%s is not a capture.\n", path);
+    if(reader->header->version != CAPTURE_VERSION) die("%s is a capture of version %u.\n", path, reader->header->version);
+}
+
+bool capture_get_varint(CaptureReader *reader, uint64_t *value) {
+    *value = 0;
+    for(int shift = 0; shift < 64 && reader->offset < reader->size; shift += 7) {
+        uint8_t byte = reader->map[reader->offset++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+// the next request and the ns since the previous one, false at the end of the log
+bool capture_next(CaptureReader *reader, uint64_t *delay, const uint8_t **body, size_t *n) {
+    if(!reader->map || reader->offset >= reader->size) return false;
+    uint64_t length;
+    if(!capture_get_varint(reader, delay) || !capture_get_varint(reader, &length) || length > reader->size - reader->offset) {
+        reader->truncated = true;
+        return false;
+    }
+    *body = reader->map + reader->offset;
+    *n = length;
+    reader->offset += length;
+    return true;
+}
+
+void capture_reader_rewind(CaptureReader *reader) {
+    reader->offset = sizeof(CaptureHeader);
+}
+
+void capture_reader_close(CaptureReader *reader) {
+    if(reader->map) munmap(reader->map, reader->size);
+}
+
+#endif // _CAPTURE_H
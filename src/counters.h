@@ -0,0 +1,103 @@
+// counters.h
+// Hardware performance counters read with perf_event_open
+//
+// every counter is opened on its own, so a machine or container missing some of them still
+// reports the others. when the kernel runs more counters than the hardware has, it rotates
+// them and the counts are scaled up by the share of the time each one was running
+
+#ifndef _COUNTERS_H
+#define _COUNTERS_H
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "shunting.h"
+
+typedef enum Counter {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_L1D_MISSES,
+    COUNTER_LLC_MISSES,
+    COUNTER_COUNT
+} Counter;
+
+const char *COUNTER_NAMES[COUNTER_COUNT] = { "cycles", "instructions", "branch-misses", "L1d-misses", "LLC-misses" };
+
+typedef struct PerfCounters {
+    int    fds[COUNTER_COUNT];      // -1 for a counter that isn't available
+    double values[COUNTER_COUNT];   // added up over every start and stop
+    int    error;                   // errno of the first counter that failed to open
+} PerfCounters;
+
+static const struct { uint32_t type; uint64_t config; } COUNTER_EVENTS[COUNTER_COUNT] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+};
+
+// opens the counters of the calling thread, user space only so it works at perf_event_paranoid 2
+void perf_counters_open(PerfCounters *counters) {
+    counters->error = 0;
+    for(int c = 0; c < COUNTER_COUNT; c++) {
+        struct perf_event_attr attr = { 0 };
+        attr.size = sizeof(attr);
+        attr.type = COUNTER_EVENTS[c].type;
+        attr.config = COUNTER_EVENTS[c].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fds[c] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if(counters->fds[c] < 0 && !counters->error) counters->error = errno;
+        counters->values[c] = 0;
+    }
+}
+
+bool perf_counter_available(const PerfCounters *counters, Counter c) {
+    return counters->fds[c] >= 0;
+}
+
+// the number of counters that opened
+int perf_counters_available(const PerfCounters *counters) {
+    int n = 0;
+    for(int c = 0; c < COUNTER_COUNT; c++) n += perf_counter_available(counters, c);
+    return n;
+}
+
+void perf_counters_reset(PerfCounters *counters) {
+    for(int c = 0; c < COUNTER_COUNT; c++) counters->values[c] = 0;
+}
+
+void perf_counters_start(PerfCounters *counters) {
+    for(int c = 0; c < COUNTER_COUNT; c++) {
+        if(counters->fds[c] < 0) continue;
+        ioctl(counters->fds[c], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[c], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+// stops the counters and adds what they counted since the start
+void perf_counters_stop(PerfCounters *counters) {
+    for(int c = 0; c < COUNTER_COUNT; c++) {
+        if(counters->fds[c] >= 0) ioctl(counters->fds[c], PERF_EVENT_IOC_DISABLE, 0);
+    }
+    for(int c = 0; c < COUNTER_COUNT; c++) {
+        uint64_t read_values[3]; // count, time enabled, time running
+        if(counters->fds[c] < 0 || read(counters->fds[c], read_values, sizeof(read_values)) != sizeof(read_values)) continue;
+        if(read_values[2]) counters->values[c] += (double)read_values[0] * read_values[1] / read_values[2];
+    }
+}
+
+void perf_counters_close(PerfCounters *counters) {
+    for(int c = 0; c < COUNTER_COUNT; c++) {
+        if(counters->fds[c] >= 0) close(counters->fds[c]);
+        counters->fds[c] = -1;
+    }
+}
+
+#endif // _COUNTERS_H
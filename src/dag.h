@@ -0,0 +1,183 @@
+// dag.h
+// Hash-consed expression DAG built from compiled programs
+//
+// structurally equal subexpressions become one node, and a rewriting constructor
+// can be plugged in to transform nodes as they are built
+
+#ifndef _DAG_H
+#define _DAG_H
+
+#include "program.h"
+
+#define DAG_NONE UINT32_MAX // missing operand of a node
+
+typedef struct DagNode {
+    uint8_t   op;          // opcode, see IS_LEAF_OP and IS_UNARY_OP
+    long long arg;         // constant or variable of a leaf
+    uint32_t  left, right; // operands, right is DAG_NONE for unary operations
+    bool      fails;       // evaluating the node may die, through a division or decimal overflow
+} DagNode;
+
+typedef struct Dag Dag;
+
+// builds the node for op over the operands and returns its index
+typedef uint32_t (*DagBuild)(Dag *dag, uint8_t op, long long arg, uint32_t left, uint32_t right);
+
+struct Dag {
+    DagNode  *nodes; // operands always come before their users
+    size_t    count, capacity;
+    uint32_t *table; // hash cons table of node index + 1, 0 if empty
+    size_t    table_size;
+    uint32_t *roots; // result node of each formula
+    size_t    nroots;
+    uint32_t  vars;  // bit n is set if variable n is used
+    DagBuild  build; // used by dag_add_program, dag_node unless a rewriting constructor is plugged in
+};
+
+uint32_t dag_node(Dag *dag, uint8_t op, long long arg, uint32_t left, uint32_t right);
+
+void dag_init(Dag *dag) {
+    dag->nodes = NULL;
+    dag->count = dag->capacity = 0;
+    dag->table_size = 64;
+    dag->table = calloc(dag->table_size, sizeof(*dag->table));
+    dag->roots = NULL;
+    dag->nroots = 0;
+    dag->vars = 0;
+    dag->build = dag_node;
+}
+
+void dag_free(Dag *dag) {
+    free(dag->nodes);
+    free(dag->table);
+    free(dag->roots);
+}
+
+uint64_t dag_hash(uint8_t op, long long arg, uint32_t left, uint32_t right) {
+    uint64_t h = op * 0x9e3779b97f4a7c15ull;
+    h = (h ^ (uint64_t)arg) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ ((uint64_t)left << 32 | right)) * 0x94d049bb133111ebull;
+    return h ^ h >> 31;
+}
+
+// returns the slot of the hash cons table holding the node or the empty slot where it belongs
+uint32_t *dag_lookup(Dag *dag, uint8_t op, long long arg, uint32_t left, uint32_t right) {
+    size_t mask = dag->table_size - 1;
+    for(size_t i = dag_hash(op, arg, left, right) & mask;; i = (i + 1) & mask) {
+        if(!dag->table[i]) return &dag->table[i];
+        DagNode *node = &dag->nodes[dag->table[i] - 1];
+        if(node->op == op && node->arg == arg && node->left == left && node->right == right) return &dag->table[i];
+    }
+}
+
+// returns the node computing op over the operands, creating it unless an equal one exists
+uint32_t dag_node(Dag *dag, uint8_t op, long long arg, uint32_t left, uint32_t right) {
+    // addition and multiplication commute, so order their operands to share a*b with b*a
+    if((op == OP_ADD || op == OP_MUL || op == OP_DADD || op == OP_DMUL || op == OP_MADD || op == OP_MMUL) && left > right) {
+        uint32_t swap = left;
+        left = right;
+        right = swap;
+    }
+
+    uint32_t *slot = dag_lookup(dag, op, arg, left, right);
+    if(*slot) return *slot - 1;
+
+    if(dag->count == dag->capacity) {
+        dag->capacity = dag->capacity ? dag->capacity * 2 : 64;
+        dag->nodes = realloc(dag->nodes, sizeof(*dag->nodes) * dag->capacity);
+    }
+    // division by a constant other than 0 and -1 always succeeds, decimal operations may overflow
+    bool fails = (left != DAG_NONE && dag->nodes[left].fails) || (right != DAG_NONE && dag->nodes[right].fails) ||
+        (op == OP_DIV && (dag->nodes[right].op != OP_PUSH || dag->nodes[right].arg == 0 || dag->nodes[right].arg == -1)) ||
+        (op >= OP_DADD && op <= OP_DNEG) || op == OP_MDIV;
+    dag->nodes[dag->count] = (DagNode){ op, arg, left, right, fails };
+    *slot = ++dag->count;
+
+    // keep the table at most half full
+    if(dag->count * 2 > dag->table_size) {
+        free(dag->table);
+        dag->table_size *= 2;
+        dag->table = calloc(dag->table_size, sizeof(*dag->table));
+        for(uint32_t n = 0; n < dag->count; n++) {
+            DagNode *node = &dag->nodes[n];
+            *dag_lookup(dag, node->op, node->arg, node->left, node->right) = n + 1;
+        }
+    }
+    return dag->count - 1;
+}
+
+// adds a compiled program as the next formula
+void dag_add_program(Dag *dag, Program *program) {
+    uint32_t *stack = malloc(sizeof(*stack) * program->depth), top = 0;
+    for(size_t i = 0; i < program->length; i++) {
+        uint8_t op = program->code[i];
+        if(IS_LEAF_OP(op)) {
+            stack[top++] = dag->build(dag, op, program->args[i], DAG_NONE, DAG_NONE);
+        } else if(IS_SUPER_OP(op)) {
+            // taken apart into the leaves and the operator it stands for
+            const Superinstruction *super = &SUPERINSTRUCTIONS[op - OP_PUSH_ADD];
+            long long arg = program->args[i];
+            if(super->length == 3) {
+                stack[top++] = dag->build(dag, OP_VAR, arg & 0xff, DAG_NONE, DAG_NONE);
+                arg >>= 8;
+            }
+            uint32_t leaf = dag->build(dag, super->sequence[super->length - 2], arg, DAG_NONE, DAG_NONE);
+            stack[top - 1] = dag->build(dag, super->sequence[super->length - 1], 0, stack[top - 1], leaf);
+        } else if(IS_UNARY_OP(op)) {
+            stack[top - 1] = dag->build(dag, op, program->args[i], stack[top - 1], DAG_NONE);
+        } else {
+            top--;
+            stack[top - 1] = dag->build(dag, op, 0, stack[top - 1], stack[top]);
+        }
+    }
+
+    dag->roots = realloc(dag->roots, sizeof(*dag->roots) * (dag->nroots + 1));
+    dag->roots[dag->nroots++] = stack[0];
+    dag->vars |= program->vars;
+    free(stack);
+}
+
+// turns the formula computed by root back into a program, repeating shared subexpressions.
+// vars is kept from the source program so unbound variables fail even if their uses were removed
+void dag_emit(Dag *dag, uint32_t root, Program *program, uint32_t vars) {
+    size_t capacity = 64, length = 0, depth = 0, max = 0;
+    uint8_t *code = malloc(capacity);
+    long long *args = malloc(sizeof(*args) * capacity);
+
+    // post-order walk, the top bit of an entry marks a node whose operands have been emitted
+    size_t stack_capacity = 64, top = 0;
+    uint32_t *stack = malloc(sizeof(*stack) * stack_capacity);
+    stack[top++] = root;
+    while(top) {
+        uint32_t entry = stack[--top], n = entry & ~(1u << 31);
+        DagNode *node = &dag->nodes[n];
+
+        if(!(entry >> 31) && node->left != DAG_NONE) {
+            if(top + 3 > stack_capacity) stack = realloc(stack, sizeof(*stack) * (stack_capacity *= 2));
+            stack[top++] = n | 1u << 31;
+            if(node->right != DAG_NONE) stack[top++] = node->right;
+            stack[top++] = node->left;
+            continue;
+        }
+
+        if(length == capacity) {
+            capacity *= 2;
+            code = realloc(code, capacity);
+            args = realloc(args, sizeof(*args) * capacity);
+        }
+        code[length] = node->op;
+        args[length++] = node->arg;
+        if(node->left == DAG_NONE) depth++;
+        else if(node->right != DAG_NONE) depth--;
+        if(depth > max) max = depth;
+    }
+    free(stack);
+
+    program->code = code;
+    program->args = args;
+    program->length = length;
+    program->depth = max;
+    program->vars = vars;
+}
+
+#endif // _DAG_H
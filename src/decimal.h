@@ -0,0 +1,148 @@
+// decimal.h
+// Fixed-point decimal arithmetic for decimal mode
+//
+// a decimal is a long long holding the number multiplied by decimal_scale. products and
+// quotients are rescaled with the selected rounding, and every operation reports overflow
+// instead of wrapping. the operations return NULL or an error message without the period
+
+#ifndef _DECIMAL_H
+#define _DECIMAL_H
+
+#include "shunting.h"
+#include "divide.h"
+
+typedef enum Rounding {
+    ROUND_HALF_EVEN, // to the nearest, ties to the even neighbour
+    ROUND_HALF_UP,   // to the nearest, ties away from zero
+    ROUND_DOWN,      // towards zero
+    ROUND_FLOOR,     // towards negative infinity
+    ROUND_CEILING,   // towards positive infinity
+} Rounding;
+
+static const char *ROUNDING_NAMES[] = { "half-even", "half-up", "down", "floor", "ceiling" };
+
+Rounding decimal_rounding = ROUND_HALF_EVEN;
+Divisor  decimal_divisor = { .divisor = 1 }; // decimal_scale and its reciprocal for rescaling products
+
+// switches to decimal mode with the given number of places
+void decimal_mode(int places) {
+    decimal_enable(places);
+    if(decimal_scale > 1) divisor_init(&decimal_divisor, decimal_scale);
+    else decimal_divisor = (Divisor){ .divisor = 1 };
+}
+
+void decimal_set_rounding(const char *name) {
+    for(size_t i = 0; i < sizeof(ROUNDING_NAMES) / sizeof(*ROUNDING_NAMES); i++) {
+        if(!strcmp(ROUNDING_NAMES[i], name)) {
+            decimal_rounding = i;
+            return;
+        }
+    }
+    die("Unknown rounding %s, use half-even, half-up, down, floor or ceiling.\n", name);
+}
+
+// rounds the truncated quotient q given the magnitudes of the remainder and the divisor.
+// the operations take the scale and the rounding as arguments, so loops over rows can keep
+// the scale in registers and be specialized for each rounding
+static inline __int128 decimal_round(__int128 q, unsigned long long remainder, unsigned long long divisor, bool negative, Rounding mode) {
+    if(!remainder) return q;
+    bool away;
+    switch(mode) {
+        case ROUND_HALF_EVEN: away = 2 * remainder > divisor || (2 * remainder == divisor && (q & 1)); break;
+        case ROUND_HALF_UP:   away = 2 * remainder >= divisor; break;
+        case ROUND_FLOOR:     away = negative;  break;
+        case ROUND_CEILING:   away = !negative; break;
+        default:              away = false;     break;
+    }
+    return away ? (negative ? q - 1 : q + 1) : q;
+}
+
+// n / d rounded, for quotients that need the wide path
+static inline const char *decimal_quotient(__int128 n, long long d, long long *out, Rounding mode) {
+    __int128 q = n / d, r = n % d;
+    q = decimal_round(q, r < 0 ? -r : r, d < 0 ? -(unsigned long long)d : (unsigned long long)d, (n < 0) != (d < 0), mode);
+    if(q > LLONG_MAX || q < LLONG_MIN) return "Decimal overflow";
+    *out = q;
+    return NULL;
+}
+
+static inline const char *decimal_add(long long a, long long b, long long *out, const Divisor *scale, Rounding mode) {
+    (void)scale, (void)mode;
+    return __builtin_add_overflow(a, b, out) ? "Decimal overflow" : NULL;
+}
+
+static inline const char *decimal_sub(long long a, long long b, long long *out, const Divisor *scale, Rounding mode) {
+    (void)scale, (void)mode;
+    return __builtin_sub_overflow(a, b, out) ? "Decimal overflow" : NULL;
+}
+
+// b is unused, so negation fits the shape of the binary operations
+static inline const char *decimal_neg(long long a, long long b, long long *out, const Divisor *scale, Rounding mode) {
+    (void)b, (void)scale, (void)mode;
+    return __builtin_sub_overflow(0, a, out) ? "Decimal overflow" : NULL;
+}
+
+static inline const char *decimal_mul(long long a, long long b, long long *out, const Divisor *scale, Rounding mode) {
+    long long product;
+    if(__builtin_mul_overflow(a, b, &product)) return decimal_quotient((__int128)a * b, scale->divisor, out, mode);
+    if(scale->divisor == 1) {
+        *out = product;
+        return NULL;
+    }
+
+    // products that fit rescale through the reciprocal of the scale
+    long long q = divisor_divide(scale, product), r = product - q * scale->divisor;
+    *out = decimal_round(q, r < 0 ? -r : r, scale->divisor, product < 0, mode);
+    return NULL;
+}
+
+static inline const char *decimal_div(long long a, long long b, long long *out, const Divisor *scale, Rounding mode) {
+    if(b == 0) return "Division by zero";
+    long long n;
+    if(__builtin_mul_overflow(a, scale->divisor, &n) || (n == LLONG_MIN && b == -1)) {
+        return decimal_quotient((__int128)a * scale->divisor, b, out, mode);
+    }
+    long long q = n / b, r = n % b;
+    *out = decimal_round(q, r < 0 ? -r : r, b < 0 ? -(unsigned long long)b : (unsigned long long)b, (n < 0) != (b < 0), mode);
+    return NULL;
+}
+
+// a to a whole power by squaring, rounding after every multiplication
+static inline const char *decimal_pow(long long a, long long b, long long *out, const Divisor *scale, Rounding mode) {
+    if(b % scale->divisor) return "Fractional exponent";
+    long long e = b / scale->divisor;
+    unsigned long long bits = e < 0 ? -(unsigned long long)e : (unsigned long long)e;
+
+    long long result = scale->divisor;
+    const char *error;
+    while(bits) {
+        if(bits & 1 && (error = decimal_mul(result, a, &result, scale, mode))) return error;
+        bits >>= 1;
+        if(bits && (error = decimal_mul(a, a, &a, scale, mode))) return error;
+    }
+    return e < 0 ? decimal_div(scale->divisor, result, out, scale, mode) : (*out = result, NULL);
+}
+
+typedef const char *(*DecimalOp)(long long a, long long b, long long *out, const Divisor *scale, Rounding mode);
+
+// applies the operation to n rows of a block with a fixed rounding, dying with the row of the first error
+static inline void decimal_rows(DecimalOp op, Rounding mode, long long *out, const long long *a, const long long *b, size_t n, size_t base) {
+    Divisor scale = decimal_divisor;
+    for(size_t r = 0; r < n; r++) {
+        const char *error = op(a[r], b[r], &out[r], &scale, mode);
+        if(error) die("%s in row %zu.\n", error, base + r + 1);
+    }
+}
+
+// applies the operation to n rows of a block, with a loop specialized for the rounding
+static inline void decimal_block(DecimalOp op, long long *out, const long long *a, const long long *b, size_t n, size_t base) {
+    switch(decimal_rounding) {
+        case ROUND_HALF_EVEN: decimal_rows(op, ROUND_HALF_EVEN, out, a, b, n, base); break;
+        case ROUND_HALF_UP:   decimal_rows(op, ROUND_HALF_UP,   out, a, b, n, base); break;
+        case ROUND_DOWN:      decimal_rows(op, ROUND_DOWN,      out, a, b, n, base); break;
+        case ROUND_FLOOR:     decimal_rows(op, ROUND_FLOOR,     out, a, b, n, base); break;
+        case ROUND_CEILING:   decimal_rows(op, ROUND_CEILING,   out, a, b, n, base); break;
+    }
+}
+
+#endif // _DECIMAL_H
@@ -0,0 +1,152 @@
+// disasm.h
+// Listings of compiled programs and time spent in each of their instructions
+//
+// a stack program is listed with the stack depth after every instruction, a fused register
+// program with the slots every operation reads and writes. timing runs the program many
+// times reading the cycle counter around each instruction
+
+#ifndef _DISASM_H
+#define _DISASM_H
+
+#include <time.h>
+#include "program.h"
+#include "fused.h"
+
+#ifdef __x86_64__
+#include <x86intrin.h>
+#define TIMER_UNIT "cycles"
+static inline unsigned long long timer_read() { return __rdtsc(); }
+#else
+#define TIMER_UNIT "ns"
+static inline unsigned long long timer_read() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+#endif
+
+// writes the argument of an instruction the way it was written in the expression. in modular
+// mode constants are in Montgomery form, besides the plain ones in the exponents of OP_MEXP
+int sprint_operand(char *buffer, size_t size, uint8_t op, long long arg, bool plain) {
+    switch(op) {
+        case OP_PUSH: return sprint_number(buffer, size, modular && !plain ? (long long)mont_out(arg, &modulus) : arg);
+        case OP_PUSH_ADD:
+        case OP_PUSH_SUB:
+        case OP_PUSH_MUL: return sprint_number(buffer, size, arg);
+        case OP_VAR:
+        case OP_MVAR:
+        case OP_VAR_ADD:
+        case OP_VAR_SUB:
+        case OP_VAR_MUL: return snprintf(buffer, size, "%c", (char)('a' + arg));
+        case OP_VAR_VAR_ADD:
+        case OP_VAR_VAR_SUB:
+        case OP_VAR_VAR_MUL: return snprintf(buffer, size, "%c %c", (char)('a' + (arg & 0xff)), (char)('a' + (arg >> 8)));
+        case OP_SHL: return snprintf(buffer, size, "%lld", arg);
+        default: buffer[0] = 0; return 0;
+    }
+}
+
+// marks the instructions computing the exponent of an OP_MEXP, like program_compile left them
+void program_plain_instructions(Program *program, bool *plain) {
+    size_t *starts = malloc(sizeof(*starts) * (program->depth + 1)); // first instruction of each operand on the stack
+    size_t top = 0;
+    for(size_t i = 0; i < program->length; i++) {
+        uint8_t op = program->code[i];
+        int effect = op_stack_effect(op);
+        plain[i] = false;
+        if(effect > 0) starts[top++] = i;
+        else if(effect < 0) top--;
+        if(op == OP_MEXP) memset(plain + starts[top], true, i - starts[top]);
+    }
+    free(starts);
+}
+
+// lists the program, with the average time of each instruction if times isn't NULL
+void program_disassemble(Program *program, const double *times, FILE *file) {
+    fprintf(file, "%5s  %-12s %-20s %5s", "#", "opcode", "operand", "depth");
+    if(times) fprintf(file, " %10s", TIMER_UNIT);
+    fprintf(file, "\n");
+
+    bool *plain = malloc(sizeof(*plain) * (program->length + 1));
+    program_plain_instructions(program, plain);
+    int depth = 0;
+    for(size_t i = 0; i < program->length; i++) {
+        char operand[64];
+        sprint_operand(operand, sizeof(operand), program->code[i], program->args[i], plain[i]);
+        depth += op_stack_effect(program->code[i]);
+        fprintf(file, "%5zu  %-12s %-20s %5d", i, OPCODE_NAMES[program->code[i]], operand, depth);
+        if(times) fprintf(file, " %10.1f", times[i]);
+        fprintf(file, "\n");
+    }
+    fprintf(file, "%zu instructions, maximum depth %zu\n", program->length, program->depth);
+    free(plain);
+}
+
+// marks the operations computing the exponent of an OP_MEXP. going backwards, an operation is
+// plain if an OP_MEXP or a plain operation reads its result as an exponent or operand
+void fused_plain_operations(FusedProgram *fused, bool *plain) {
+    size_t *writer = malloc(sizeof(*writer) * (fused->slots + 1)); // operation that last wrote each slot
+    size_t *sources = malloc(sizeof(*sources) * 2 * (fused->length + 1));
+    for(size_t i = 0; i < fused->length; i++) {
+        FusedOp *op = &fused->ops[i];
+        plain[i] = false;
+        if(op->op == OP_STORE) continue;
+        sources[2 * i] = IS_LEAF_OP(op->op) ? i : writer[op->a];
+        sources[2 * i + 1] = IS_LEAF_OP(op->op) || IS_UNARY_OP(op->op) ? i : writer[op->b];
+        writer[op->dst] = i;
+    }
+    for(size_t i = fused->length; i-- > 0;) {
+        uint8_t op = fused->ops[i].op;
+        if(op == OP_STORE || IS_LEAF_OP(op)) continue;
+        if(op == OP_MEXP) plain[sources[2 * i + 1]] = true;
+        if(plain[i]) plain[sources[2 * i]] = plain[sources[2 * i + 1]] = true;
+    }
+    free(writer);
+    free(sources);
+}
+
+// lists the register program, leaves and unary operations only read slot a
+void fused_disassemble(FusedProgram *fused, FILE *file) {
+    fprintf(file, "%5s  %-12s %-20s %s\n", "#", "opcode", "operand", "slots");
+    bool *plain = malloc(sizeof(*plain) * (fused->length + 1));
+    fused_plain_operations(fused, plain);
+    for(size_t i = 0; i < fused->length; i++) {
+        FusedOp *op = &fused->ops[i];
+        char operand[64];
+        sprint_operand(operand, sizeof(operand), op->op, op->arg, plain[i]);
+        fprintf(file, "%5zu  %-12s %-20s ", i, OPCODE_NAMES[op->op], operand);
+        if(op->op == OP_STORE) fprintf(file, "out%u = s%u\n", op->dst, op->a);
+        else if(IS_LEAF_OP(op->op)) fprintf(file, "s%u\n", op->dst);
+        else if(IS_UNARY_OP(op->op)) fprintf(file, "s%u = s%u\n", op->dst, op->a);
+        else fprintf(file, "s%u = s%u s%u\n", op->dst, op->a, op->b);
+    }
+    fprintf(file, "%zu operations, %zu formulas, %zu slots\n", fused->length, fused->outputs, fused->slots);
+    free(plain);
+}
+
+// evaluates the program the given number of times, leaving the average time of each instruction
+// in times. the cost of reading the timer is measured the same way and taken off
+void program_time(Program *program, const long long *vars, unsigned long evaluations, double *times) {
+    long long *stack = malloc(sizeof(*stack) * (program->depth + 1));
+    unsigned long long *totals = calloc(program->length, sizeof(*totals)), overhead = 0;
+
+    for(unsigned long e = 0; e < evaluations; e++) {
+        long long *top = stack;
+        for(size_t i = 0; i < program->length; i++) {
+            unsigned long long start = timer_read();
+            top = program_step(program, i, top, vars);
+            totals[i] += timer_read() - start;
+        }
+        unsigned long long start = timer_read();
+        overhead += timer_read() - start;
+    }
+
+    for(size_t i = 0; i < program->length; i++) {
+        double time = (double)totals[i] / evaluations - (double)overhead / evaluations;
+        times[i] = time > 0 ? time : 0;
+    }
+    free(totals);
+    free(stack);
+}
+
+#endif // _DISASM_H
@@ -0,0 +1,219 @@
+// diskcache.h
+// Compiled programs kept in a directory, so restarted processes don't compile them again
+//
+// every program is a file named by the hash of its expression and of the settings it was
+// compiled with: the format version, the opcodes of the build, decimal or modular mode and
+// the passes. a file is
+// written under a temporary name and renamed into place, so concurrent writers and readers
+// only ever see complete files. a checksum catches files damaged otherwise, which are
+// removed and compiled again
+
+#ifndef _DISKCACHE_H
+#define _DISKCACHE_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "program.h"
+#include "cache.h"
+
+#define DISK_CACHE_VERSION 2 // changes with the file format or with what the compiler produces
+#define DISK_CACHE_MAGIC   "SHUNTPRG"
+
+// a file is the header, the expression, the opcodes padded to 8 bytes and the arguments
+typedef struct DiskHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t vars;
+    uint64_t settings;
+    uint64_t text_length;
+    uint64_t length;
+    uint64_t depth;
+    uint64_t checksum; // of the header up to here and everything after it
+} DiskHeader;
+
+typedef struct DiskCache {
+    char    *dir;
+    uint64_t settings; // hash of everything besides the expression that changes compiled programs
+    size_t   hits, misses, corrupt, writes; // updated atomically, workers share the cache
+} DiskCache;
+
+// continues FNV-1a over more bytes
+uint64_t hash_more(uint64_t hash, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    for(size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// opens or creates the directory. call it once the mode and the passes are set
+void disk_cache_open(DiskCache *cache, const char *dir) {
+    if(mkdir(dir, 0755) && errno != EEXIST) die("Cannot create %s.\n", dir);
+    struct stat st;
+    if(stat(dir, &st) || !S_ISDIR(st.st_mode)) die("%s is not a directory.\n", dir);
+
+    // the opcode names stand for the instruction set, a build that renumbers or adds opcodes
+    // gets files of its own
+    uint64_t opcodes = 14695981039346656037ull;
+    for(int op = 0; op < OP_COUNT; op++) opcodes = hash_more(opcodes, OPCODE_NAMES[op], strlen(OPCODE_NAMES[op]) + 1);
+
+    char settings[1024];
+    int n = snprintf(settings, sizeof(settings), "version %d, opcodes %d %016llx, decimal places %d, modulus %llu, passes",
+        DISK_CACHE_VERSION, OP_COUNT, (unsigned long long)opcodes, decimal_places, modular ? modulus.n : 0);
+    for(size_t i = 0; i < program_npasses; i++) n += snprintf(settings + n, sizeof(settings) - n, " %s", program_pass_names[i]);
+
+    cache->dir = strdup(dir);
+    cache->settings = hash_text(settings, strlen(settings));
+    cache->hits = cache->misses = cache->corrupt = cache->writes = 0;
+}
+
+void disk_cache_close(DiskCache *cache) {
+    free(cache->dir);
+}
+
+void disk_cache_path(DiskCache *cache, const char *text, size_t length, char *path, size_t size) {
+    uint64_t key = hash_more(cache->settings, text, length);
+    snprintf(path, size, "%s/%016llx.prog", cache->dir, (unsigned long long)key);
+}
+
+size_t disk_code_size(uint64_t length) {
+    return (length + 7) & ~7ull;
+}
+
+uint64_t disk_checksum(const DiskHeader *header, const uint8_t *data, size_t size) {
+    return hash_more(hash_more(14695981039346656037ull, header, offsetof(DiskHeader, checksum)), data, size);
+}
+
+// true if every opcode exists, every variable is a letter, every shift fits and the stack
+// reaches exactly the depth of the header and ends with one result, so evaluation can't index
+// past its tables or its stack whatever the file says
+bool disk_program_valid(const Program *program) {
+    if(program->vars >> VARIABLES) return false;
+    size_t depth = 0, max = 0;
+    for(size_t i = 0; i < program->length; i++) {
+        uint8_t op = program->code[i];
+        long long arg = program->args[i];
+        if(op >= OP_COUNT || op == OP_STORE) return false;
+
+        // unary operations and superinstructions take one operand, binary ones two
+        int effect = op_stack_effect(op);
+        if(depth < (effect < 0 ? 2 : effect == 0 ? 1 : 0)) return false;
+        depth += effect;
+        if(depth > max) max = depth;
+
+        if(op == OP_SHL && (arg < 0 || arg > 63)) return false;
+        if(op == OP_VAR || op == OP_MVAR || op == OP_VAR_ADD || op == OP_VAR_SUB || op == OP_VAR_MUL) {
+            if(arg < 0 || arg >= VARIABLES) return false;
+        }
+        if(op == OP_VAR_VAR_ADD || op == OP_VAR_VAR_SUB || op == OP_VAR_VAR_MUL) {
+            if(arg < 0 || (arg & 0xff) >= VARIABLES || arg >> 8 >= VARIABLES) return false;
+        }
+    }
+    return depth == 1 && max == program->depth;
+}
+
+// reads the program of the expression if the cache has it, removing damaged files
+bool disk_cache_load(DiskCache *cache, const char *text, size_t length, Program *program) {
+    char path[4096];
+    disk_cache_path(cache, text, length, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) {
+        __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    struct stat st;
+    uint8_t *map = MAP_FAILED;
+    if(!fstat(fd, &st) && st.st_size >= (off_t)sizeof(DiskHeader)) map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    const DiskHeader *header = (const DiskHeader *)map;
+    const uint8_t *data = map + sizeof(*header);
+    size_t size = map != MAP_FAILED ? st.st_size - sizeof(*header) : 0;
+    bool valid = map != MAP_FAILED && !memcmp(header->magic, DISK_CACHE_MAGIC, 8) && header->version == DISK_CACHE_VERSION &&
+                 header->length <= size / 9 && header->text_length <= size &&
+                 header->text_length + disk_code_size(header->length) + header->length * 8 == size &&
+                 header->checksum == disk_checksum(header, data, size);
+    if(!valid) {
+        if(map != MAP_FAILED) munmap(map, st.st_size);
+        unlink(path);
+        __atomic_fetch_add(&cache->corrupt, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    // another expression or settings with the same hash is a miss, not damage
+    if(header->settings != cache->settings || header->text_length != length || memcmp(data, text, length)) {
+        munmap(map, st.st_size);
+        __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    const uint8_t *code = data + length;
+    program->length = header->length;
+    program->depth = header->depth;
+    program->vars = header->vars;
+    program->code = malloc(program->length + 1);
+    program->args = malloc(sizeof(*program->args) * (program->length + 1));
+    memcpy(program->code, code, program->length);
+    memcpy(program->args, code + disk_code_size(program->length), sizeof(*program->args) * program->length);
+    munmap(map, st.st_size);
+    if(!disk_program_valid(program)) {
+        program_free(program);
+        unlink(path);
+        __atomic_fetch_add(&cache->corrupt, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache->misses, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    __atomic_fetch_add(&cache->hits, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+// writes the program under a name no other writer uses, then renames it into place.
+// the cache is only an optimization, so failures just leave the program out
+void disk_cache_store(DiskCache *cache, const char *text, size_t length, const Program *program) {
+    static unsigned long sequence = 0;
+    char path[4096], temporary[4096 + 64];
+    disk_cache_path(cache, text, length, path, sizeof(path));
+    snprintf(temporary, sizeof(temporary), "%s.%d.%lu.tmp", path, (int)getpid(), __atomic_fetch_add(&sequence, 1, __ATOMIC_RELAXED));
+
+    size_t size = length + disk_code_size(program->length) + sizeof(*program->args) * program->length;
+    uint8_t *data = calloc(1, size + 1);
+    memcpy(data, text, length);
+    memcpy(data + length, program->code, program->length);
+    memcpy(data + length + disk_code_size(program->length), program->args, sizeof(*program->args) * program->length);
+
+    DiskHeader header = { .version = DISK_CACHE_VERSION, .vars = program->vars, .settings = cache->settings,
+                          .text_length = length, .length = program->length, .depth = program->depth };
+    memcpy(header.magic, DISK_CACHE_MAGIC, 8);
+    header.checksum = disk_checksum(&header, data, size);
+
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    bool written = fd >= 0 && write(fd, &header, sizeof(header)) == sizeof(header) && write(fd, data, size) == (ssize_t)size;
+    if(fd >= 0) close(fd);
+    if(written && !rename(temporary, path)) __atomic_fetch_add(&cache->writes, 1, __ATOMIC_RELAXED);
+    else unlink(temporary);
+    free(data);
+}
+
+// loads the program of the expression from the cache, or compiles and stores it
+void program_compile_cached(Program *program, char *expression, DiskCache *cache) {
+    if(!cache) {
+        program_compile_text(program, expression);
+        return;
+    }
+    size_t length = strlen(expression);
+    if(disk_cache_load(cache, expression, length, program)) return;
+    program_compile_text(program, expression);
+    disk_cache_store(cache, expression, length, program);
+}
+
+void disk_cache_print_stats(DiskCache *cache, FILE *file) {
+    fprintf(file, "disk cache hits: %zu, misses: %zu, corrupt: %zu, writes: %zu\n",
+        cache->hits, cache->misses, cache->corrupt, cache->writes);
+}
+
+#endif // _DISKCACHE_H
@@ -0,0 +1,139 @@
+// divide.h
+// Division by invariant divisors through multiply-high and shift
+//
+// a divisor that stays the same over many rows gets a magic reciprocal once,
+// after which every quotient is the high half of a multiplication, a shift and a
+// sign correction, the same truncating quotient as C division (Hacker's Delight, 10-1)
+
+#ifndef _DIVIDE_H
+#define _DIVIDE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <limits.h>
+
+typedef struct Divisor {
+    long long divisor;
+    long long magic;
+    long long adjust; // multiple of the dividend to add to the high product: 1, -1 or 0
+    int       shift;
+} Divisor;
+
+// computes the reciprocal of a divisor whose magnitude is at least 2
+void divisor_init(Divisor *div, long long d) {
+    const uint64_t two63 = 1ull << 63;
+    uint64_t ad = d < 0 ? -(uint64_t)d : (uint64_t)d;
+    uint64_t t = two63 + ((uint64_t)d >> 63);
+    uint64_t anc = t - 1 - t % ad; // absolute value of nc
+    int p = 63;
+    uint64_t q1 = two63 / anc, r1 = two63 - q1 * anc; // 2^p / |nc| and remainder
+    uint64_t q2 = two63 / ad, r2 = two63 - q2 * ad;   // 2^p / |d| and remainder
+    uint64_t delta;
+    do {
+        p++;
+        q1 *= 2; r1 *= 2;
+        if(r1 >= anc) { q1++; r1 -= anc; }
+        q2 *= 2; r2 *= 2;
+        if(r2 >= ad) { q2++; r2 -= ad; }
+        delta = ad - r2;
+    } while(q1 < delta || (q1 == delta && r1 == 0));
+
+    div->divisor = d;
+    div->magic = d < 0 ? -(int64_t)(q2 + 1) : (int64_t)(q2 + 1);
+    div->adjust = d > 0 && div->magic < 0 ? 1 : d < 0 && div->magic > 0 ? -1 : 0;
+    div->shift = p - 64;
+}
+
+static inline long long divisor_divide(const Divisor *div, long long n) {
+    long long q = (long long)(((__int128)div->magic * n) >> 64) + div->adjust * n;
+    q >>= div->shift;
+    return q + (long long)((unsigned long long)q >> 63);
+}
+
+#ifdef __x86_64__
+#include <immintrin.h>
+
+// the same quotients four rows at a time. avx2 has no 64-bit high multiplication or arithmetic
+// shift, so both are put together from 32-bit multiplications and logical shifts.
+// returns the number of rows done, a multiple of four
+__attribute__((target("avx2")))
+size_t divisor_divide_avx2(const Divisor *div, long long *out, const long long *in, size_t n) {
+    const __m256i low = _mm256_set1_epi64x(0xffffffff), zero = _mm256_setzero_si256();
+    const __m256i magic = _mm256_set1_epi64x(div->magic), magic_high = _mm256_srli_epi64(magic, 32);
+    const __m256i magic_sign = _mm256_set1_epi64x(div->magic < 0 ? -1 : 0);
+    const __m256i add = _mm256_set1_epi64x(div->adjust > 0 ? -1 : 0), sub = _mm256_set1_epi64x(div->adjust < 0 ? -1 : 0);
+    const __m128i shift = _mm_cvtsi32_si128(div->shift);
+
+    size_t r = 0;
+    for(; r + 4 <= n; r += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(in + r));
+        __m256i x_high = _mm256_srli_epi64(x, 32);
+        __m256i x_sign = _mm256_cmpgt_epi64(zero, x);
+
+        // unsigned high product from the four 32-bit partial products
+        __m256i ll = _mm256_mul_epu32(x, magic), lh = _mm256_mul_epu32(x, magic_high);
+        __m256i hl = _mm256_mul_epu32(x_high, magic), hh = _mm256_mul_epu32(x_high, magic_high);
+        __m256i t = _mm256_add_epi64(hl, _mm256_srli_epi64(ll, 32));
+        __m256i w = _mm256_add_epi64(_mm256_and_si256(t, low), lh);
+        __m256i q = _mm256_add_epi64(hh, _mm256_add_epi64(_mm256_srli_epi64(t, 32), _mm256_srli_epi64(w, 32)));
+
+        // signed high product, then the adjustment of divisor_divide
+        q = _mm256_sub_epi64(q, _mm256_and_si256(x_sign, magic));
+        q = _mm256_sub_epi64(q, _mm256_and_si256(magic_sign, x));
+        q = _mm256_add_epi64(q, _mm256_and_si256(add, x));
+        q = _mm256_sub_epi64(q, _mm256_and_si256(sub, x));
+
+        // arithmetic shift and rounding towards zero
+        __m256i q_sign = _mm256_cmpgt_epi64(zero, q);
+        q = _mm256_xor_si256(_mm256_srl_epi64(_mm256_xor_si256(q, q_sign), shift), q_sign);
+        q = _mm256_add_epi64(q, _mm256_srli_epi64(q, 63));
+        _mm256_storeu_si256((__m256i *)(out + r), q);
+    }
+    return r;
+}
+#endif
+
+#define DIVISOR_CACHE 8 // reciprocals remembered by one evaluation, by divisor
+
+typedef struct DivisorCache {
+    Divisor entries[DIVISOR_CACHE];
+} DivisorCache;
+
+void divisor_cache_init(DivisorCache *cache) {
+    // 0 is never divided by, so it marks an empty entry
+    for(int i = 0; i < DIVISOR_CACHE; i++) cache->entries[i].divisor = 0;
+}
+
+Divisor *divisor_cache_get(DivisorCache *cache, long long d) {
+    Divisor *div = &cache->entries[(unsigned long long)d % DIVISOR_CACHE];
+    if(div->divisor != d) divisor_init(div, d);
+    return div;
+}
+
+// divides a by b for n rows into out, which may be a or b. rows with the same divisor
+// throughout, a literal or a constant column, use the reciprocal. returns false without
+// dividing if a divisor is 0 or a division overflows, for the caller to report the row
+bool divide_block(long long *out, const long long *a, const long long *b, size_t n, DivisorCache *cache) {
+    long long d = b[0];
+    bool uniform = true;
+    for(size_t r = 0; r < n; r++) uniform &= b[r] == d;
+
+    if(uniform && (d > 1 || d < -1)) {
+        Divisor div = *divisor_cache_get(cache, d);
+        size_t r = 0;
+#ifdef __x86_64__
+        if(__builtin_cpu_supports("avx2")) r = divisor_divide_avx2(&div, out, a, n);
+#endif
+        for(; r < n; r++) out[r] = divisor_divide(&div, a[r]);
+        return true;
+    }
+
+    for(size_t r = 0; r < n; r++) {
+        if(b[r] == 0 || (b[r] == -1 && a[r] == LLONG_MIN)) return false;
+    }
+    for(size_t r = 0; r < n; r++) out[r] = a[r] / b[r];
+    return true;
+}
+
+#endif // _DIVIDE_H
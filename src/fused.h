@@ -0,0 +1,131 @@
+// fused.h
+// Evaluation of many formulas in a single pass, sharing their common subexpressions
+//
+// the programs are hash-consed into one DAG, so structurally equal subexpressions become one node,
+// and the DAG is lowered to a register program working on blocks of rows like program_eval_batch.
+// every variable column is loaded once per block and every node is computed once per row
+
+#ifndef _FUSED_H
+#define _FUSED_H
+
+#include "dag.h"
+#include "batch.h"
+
+typedef struct FusedOp {
+    uint8_t   op;
+    uint32_t  dst, a, b; // scratch slots, OP_STORE copies slot a to output number dst
+    long long arg;       // constant or variable of a leaf, shift of OP_SHL
+} FusedOp;
+
+typedef struct FusedProgram {
+    FusedOp *ops;
+    size_t   length;
+    size_t   slots;   // scratch slots of BATCH_BLOCK values needed
+    size_t   outputs; // number of formulas
+    uint32_t vars;
+} FusedProgram;
+
+// lowers the DAG in node order, giving a slot back as soon as its node's last user is computed
+void fused_compile(FusedProgram *fused, Dag *dag) {
+    uint32_t *last_use = malloc(sizeof(*last_use) * (dag->count + 1));
+    uint32_t *slot = malloc(sizeof(*slot) * (dag->count + 1));
+    uint32_t *free_slots = malloc(sizeof(*free_slots) * (dag->count + 1));
+    size_t nfree = 0;
+
+    for(uint32_t n = 0; n < dag->count; n++) {
+        last_use[n] = n;
+        if(dag->nodes[n].left != DAG_NONE) last_use[dag->nodes[n].left] = n;
+        if(dag->nodes[n].right != DAG_NONE) last_use[dag->nodes[n].right] = n;
+    }
+
+    fused->ops = malloc(sizeof(*fused->ops) * (dag->count + dag->nroots + 1));
+    fused->length = fused->slots = 0;
+    fused->outputs = dag->nroots;
+    fused->vars = dag->vars;
+
+    for(uint32_t n = 0; n < dag->count; n++) {
+        DagNode *node = &dag->nodes[n];
+        FusedOp *op = &fused->ops[fused->length++];
+        op->op = node->op;
+        op->arg = node->arg;
+        op->a = node->left != DAG_NONE ? slot[node->left] : 0;
+        op->b = node->right != DAG_NONE ? slot[node->right] : 0;
+
+        // operands used for the last time can hold the result, the operations work element by element
+        if(node->left != DAG_NONE && last_use[node->left] == n) free_slots[nfree++] = slot[node->left];
+        if(node->right != DAG_NONE && node->right != node->left && last_use[node->right] == n) free_slots[nfree++] = slot[node->right];
+        slot[n] = op->dst = nfree ? free_slots[--nfree] : fused->slots++;
+
+        for(size_t r = 0; r < dag->nroots; r++) {
+            if(dag->roots[r] != n) continue;
+            fused->ops[fused->length++] = (FusedOp){ OP_STORE, r, slot[n], 0, 0 };
+        }
+        if(last_use[n] == n) free_slots[nfree++] = slot[n];
+    }
+
+    free(last_use);
+    free(slot);
+    free(free_slots);
+}
+
+void fused_free(FusedProgram *fused) {
+    free(fused->ops);
+}
+
+// evaluates every formula for every row, out holds one array of rows results per formula.
+// scratch holds at least fused->slots * BATCH_BLOCK values
+void fused_eval_batch(FusedProgram *fused, Columns *columns, long long **out, long long *scratch) {
+    uint32_t missing = fused->vars & ~columns->bound;
+    if(missing) die("Unbound variable %c.\n", 'a' + __builtin_ctz(missing));
+    DivisorCache divisors;
+    divisor_cache_init(&divisors);
+    if(program_profiler) program_profiler(&fused->ops[0].op, fused->length, sizeof(*fused->ops), columns->rows);
+
+    for(size_t base = 0; base < columns->rows; base += BATCH_BLOCK) {
+        size_t n = columns->rows - base < BATCH_BLOCK ? columns->rows - base : BATCH_BLOCK;
+
+        for(size_t i = 0; i < fused->length; i++) {
+            FusedOp *op = &fused->ops[i];
+            long long *d = scratch + op->dst * BATCH_BLOCK;
+            long long *a = scratch + op->a * BATCH_BLOCK, *b = scratch + op->b * BATCH_BLOCK;
+
+            switch(op->op) {
+                case OP_PUSH:  for(size_t r = 0; r < n; r++) d[r] = op->arg; break;
+                case OP_VAR:   memcpy(d, columns->values[op->arg] + base, sizeof(*d) * n); break;
+                case OP_STORE: memcpy(out[op->dst] + base, a, sizeof(*a) * n); break;
+
+                case OP_ADD: for(size_t r = 0; r < n; r++) d[r] = a[r] + b[r]; break;
+                case OP_SUB: for(size_t r = 0; r < n; r++) d[r] = a[r] - b[r]; break;
+                case OP_MUL: for(size_t r = 0; r < n; r++) d[r] = a[r] * b[r]; break;
+                case OP_EXP: for(size_t r = 0; r < n; r++) d[r] = powl(a[r], b[r]); break;
+                case OP_NEG: for(size_t r = 0; r < n; r++) d[r] = -a[r]; break;
+                case OP_SHL: for(size_t r = 0; r < n; r++) d[r] = op_shl(a[r], op->arg); break;
+                case OP_SQUARE: for(size_t r = 0; r < n; r++) d[r] = op_square(a[r]); break;
+
+                case OP_DADD: decimal_block(decimal_add, d, a, b, n, base); break;
+                case OP_DSUB: decimal_block(decimal_sub, d, a, b, n, base); break;
+                case OP_DMUL: decimal_block(decimal_mul, d, a, b, n, base); break;
+                case OP_DDIV: decimal_block(decimal_div, d, a, b, n, base); break;
+                case OP_DEXP: decimal_block(decimal_pow, d, a, b, n, base); break;
+                case OP_DNEG: decimal_block(decimal_neg, d, a, a, n, base); break;
+
+                case OP_MVAR: for(size_t r = 0; r < n; r++) d[r] = mont_in(columns->values[op->arg][base + r], &modulus); break;
+                case OP_MADD: modular_block(mod_add, d, a, b, n, base); break;
+                case OP_MSUB: modular_block(mod_sub, d, a, b, n, base); break;
+                case OP_MMUL: modular_block(mod_mul, d, a, b, n, base); break;
+                case OP_MDIV: modular_block(mod_div, d, a, b, n, base); break;
+                case OP_MEXP: modular_block(mod_pow, d, a, b, n, base); break;
+                case OP_MNEG: modular_block(mod_neg, d, a, a, n, base); break;
+                case OP_MOUT: for(size_t r = 0; r < n; r++) d[r] = mont_out(a[r], &modulus); break;
+
+                case OP_DIV:
+                    if(!divide_block(d, a, b, n, &divisors)) batch_division_error(a, b, n, base);
+                    break;
+
+                default: die("Unknown opcode.\n");
+            }
+        }
+    }
+}
+
+#endif // _FUSED_H
@@ -0,0 +1,214 @@
+// generate.h
+// Seeded generator of random valid expressions, the same seed always giving the same ones
+//
+// an expression is a chain of operands joined by operators drawn by weight, an operand being
+// a number, a variable or a parenthesized chain, any of them possibly negated. the chain
+// needs no care for precedence, the front ends sort that out, so runs of ^ come out right
+// associative on their own. a divisor is always a nonzero number not raised to a power,
+// so integer evaluation doesn't divide by zero, and an exponent a whole number from 0 to 4
+// not raised to a power, so decimal mode takes it and it rarely overflows. other errors like
+// modular inverses of non-invertible numbers can still happen
+
+#ifndef _GENERATE_H
+#define _GENERATE_H
+
+#include "shunting.h"
+
+typedef struct GenerateConfig {
+    size_t   min_tokens, max_tokens; // per expression, roughly
+    int      max_depth;              // of nested parentheses
+    unsigned weights[5];             // of + - * / ^, in the order of OPCHARS
+    unsigned negate;                 // percent of operands with a unary minus
+    unsigned group;                  // percent of operands that are parenthesized
+    int      min_width, max_width;   // digits of a number
+    int      fraction;               // digits after the decimal point, for decimal mode
+    char     variables[27];          // letters to use, none if empty
+    unsigned variable_share;         // percent of operands that are variables
+} GenerateConfig;
+
+static const GenerateConfig GENERATE_DEFAULTS = {
+    .min_tokens = 8, .max_tokens = 32, .max_depth = 4, .weights = { 4, 4, 3, 2, 1 },
+    .negate = 10, .group = 15, .min_width = 1, .max_width = 3, .fraction = 0,
+    .variables = "", .variable_share = 25,
+};
+
+#define GENERATE_MAX_WEIGHT 256 // of all operators together
+#define GENERATE_SLACK      32  // characters past the end of an expression the generator may scribble on
+
+typedef struct Generator {
+    GenerateConfig config;
+    uint64_t       state;
+    uint8_t        ops[GENERATE_MAX_WEIGHT]; // every operator repeated by its weight, drawn from uniformly
+    unsigned       total_weight;
+    uint64_t       negate, group, variable; // the percentages as thresholds of generator_next
+    size_t         nvariables;
+    size_t         tokens;    // written so far
+    char          *c;         // where the next character goes
+} Generator;
+
+// splitmix64, fast and good enough for test inputs
+static inline uint64_t generator_next(Generator *g) {
+    uint64_t z = (g->state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// the seed of one of many independent streams of a seed, so parts of the output can be
+// generated apart and still come out the same
+uint64_t generator_stream_seed(uint64_t seed, uint64_t stream) {
+    Generator g = { .state = seed ^ stream * 0xd1b54a32d192ed03ull };
+    return generator_next(&g);
+}
+
+// uniform below n
+static inline uint64_t generator_below(Generator *g, uint64_t n) {
+    return (uint64_t)(((unsigned __int128)generator_next(g) * n) >> 64);
+}
+
+// true with the chance of the threshold
+static inline bool generator_chance(Generator *g, uint64_t threshold) {
+    return generator_next(g) < threshold;
+}
+
+uint64_t generator_threshold(unsigned percent) {
+    return percent >= 100 ? UINT64_MAX : (uint64_t)(percent / 100.0 * 18446744073709551616.0);
+}
+
+void generator_init(Generator *g, const GenerateConfig *config, uint64_t seed) {
+    g->config = *config;
+    g->state = seed;
+    g->total_weight = 0;
+    for(int i = 0; i < 5; i++) {
+        if(g->total_weight + config->weights[i] > GENERATE_MAX_WEIGHT) die("Operator weights add up to more than %d.\n", GENERATE_MAX_WEIGHT);
+        for(unsigned w = 0; w < config->weights[i]; w++) g->ops[g->total_weight++] = OPCHARS[i];
+    }
+    if(!g->total_weight) die("No operator has a weight.\n");
+    g->negate = generator_threshold(config->negate);
+    g->group = generator_threshold(config->group);
+    g->variable = generator_threshold(config->variable_share);
+    g->nvariables = strlen(config->variables);
+    if(config->min_tokens < 1 || config->min_tokens > config->max_tokens) die("Invalid token range.\n");
+    if(config->min_width < 1 || config->min_width > config->max_width || config->max_width + config->fraction > 18) {
+        die("Numbers need 1 to 18 digits.\n");
+    }
+}
+
+// the size of a buffer that holds any expression of the configuration with its terminator
+size_t generator_max_length(const GenerateConfig *config) {
+    // every token is at most a number with its decimal point
+    return config->max_tokens * (config->max_width + config->fraction + 2) + GENERATE_SLACK;
+}
+
+static const uint64_t POWERS_OF_TEN[19] = {
+    1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull, 1000000000ull,
+    10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull, 100000000000000ull,
+    1000000000000000ull, 10000000000000000ull, 100000000000000000ull, 1000000000000000000ull,
+};
+
+// writes a number of width digits from low up, one random draw for all of them. the digits
+// are always copied as a whole block, a copy as long as the random width would mispredict
+void generate_digits(Generator *g, int width, int max_width, uint64_t low) {
+    uint64_t value = low + generator_below(g, POWERS_OF_TEN[width] - low);
+    char digits[40] = { 0 }; // right-aligned in the first 20, the rest only pads the copy
+    for(int i = 19; i >= 20 - max_width; i--) {
+        digits[i] = '0' + value % 10;
+        value /= 10;
+    }
+    memcpy(g->c, digits + 20 - width, 20);
+    g->c += width;
+}
+
+void generate_number(Generator *g, bool nonzero) {
+    const GenerateConfig *config = &g->config;
+    int width = config->min_width;
+    if(config->max_width > width) width += generator_below(g, config->max_width - width + 1);
+    generate_digits(g, width, config->max_width, width > 1 || nonzero ? POWERS_OF_TEN[width - 1] : 0);
+    if(config->fraction) {
+        *g->c++ = '.';
+        generate_digits(g, config->fraction, config->fraction, 0);
+    }
+}
+
+// a small whole number, with zeros after the point in decimal mode
+void generate_exponent(Generator *g) {
+    *g->c++ = '0' + generator_below(g, 5);
+    if(g->config.fraction) {
+        *g->c++ = '.';
+        memset(g->c, '0', g->config.fraction);
+        g->c += g->config.fraction;
+    }
+}
+
+void generate_chain(Generator *g, size_t budget, int depth);
+
+// what an operand is the right side of
+typedef enum OperandRole {
+    OPERAND_ANY,
+    OPERAND_DIVISOR,
+    OPERAND_EXPONENT,
+} OperandRole;
+
+// an operand using up to budget tokens
+void generate_operand(Generator *g, size_t budget, int depth, OperandRole role) {
+    const GenerateConfig *config = &g->config;
+    if(role != OPERAND_ANY) {
+        if(role == OPERAND_DIVISOR) generate_number(g, true);
+        else generate_exponent(g);
+        g->tokens++;
+        return;
+    }
+    if(budget >= 2 && generator_chance(g, g->negate)) {
+        *g->c++ = '-';
+        g->tokens++;
+        budget--;
+    }
+    if(budget >= 5 && depth < config->max_depth && generator_chance(g, g->group)) {
+        *g->c++ = '(';
+        g->tokens += 2;
+        generate_chain(g, 1 + generator_below(g, budget - 2), depth + 1);
+        *g->c++ = ')';
+        return;
+    }
+    if(g->nvariables && generator_chance(g, g->variable)) {
+        *g->c++ = config->variables[generator_below(g, g->nvariables)];
+    } else {
+        generate_number(g, false);
+    }
+    g->tokens++;
+}
+
+// operands joined by operators, using about budget tokens
+void generate_chain(Generator *g, size_t budget, int depth) {
+    OperandRole role = OPERAND_ANY;
+    for(;;) {
+        size_t before = g->tokens;
+        generate_operand(g, budget, depth, role);
+        size_t used = g->tokens - before;
+        budget = budget > used ? budget - used : 0;
+        if(budget < 2) return;
+
+        char op = g->ops[generator_below(g, g->total_weight)];
+
+        // a power after a divisor or an exponent would make it the power, which can be zero or large
+        if(role != OPERAND_ANY && op == '^') op = '*';
+        *g->c++ = op;
+        g->tokens++;
+        budget--;
+        role = op == '/' ? OPERAND_DIVISOR : op == '^' ? OPERAND_EXPONENT : OPERAND_ANY;
+    }
+}
+
+// writes a new expression with its terminator into text, which holds at least
+// generator_max_length characters, and returns its length
+size_t generate_expression(Generator *g, char *text) {
+    const GenerateConfig *config = &g->config;
+    size_t tokens = config->min_tokens + generator_below(g, config->max_tokens - config->min_tokens + 1);
+    g->c = text;
+    g->tokens = 0;
+    generate_chain(g, tokens, 0);
+    *g->c = 0;
+    return g->c - text;
+}
+
+#endif // _GENERATE_H
@@ -0,0 +1,131 @@
+// histogram.h
+// Log-bucketed latency histograms of the phases of compiling and evaluating
+//
+// like HDR histograms, every power of two is split into HISTOGRAM_SUB linear buckets, so
+// a recorded value is off by less than 1 / HISTOGRAM_SUB whatever its size. every thread
+// records into its own histograms without locks or atomic read-modify-writes, and snapshots
+// add up the histograms of all threads while they keep recording
+
+#ifndef _HISTOGRAM_H
+#define _HISTOGRAM_H
+
+#include <pthread.h>
+#include "program.h"
+
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB      (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 44 // values from 2^44 ns, almost five hours, share the last bucket
+#define HISTOGRAM_BUCKETS  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+typedef struct Histogram {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long count;
+    uint64_t      sum; // ns
+    uint64_t      max;
+} Histogram;
+
+static inline size_t histogram_index(uint64_t value) {
+    if(value >= 1ull << HISTOGRAM_MAX_BITS) value = (1ull << HISTOGRAM_MAX_BITS) - 1;
+    if(value < HISTOGRAM_SUB) return value;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (size_t)(shift + 1) * HISTOGRAM_SUB + (value >> shift) - HISTOGRAM_SUB;
+}
+
+// the highest value that falls into the bucket
+uint64_t histogram_bucket_limit(size_t index) {
+    if(index < HISTOGRAM_SUB) return index;
+    int shift = index / HISTOGRAM_SUB - 1;
+    return ((index % HISTOGRAM_SUB + HISTOGRAM_SUB + 1ull) << shift) - 1;
+}
+
+// only the owning thread records, the relaxed stores just keep snapshots from seeing torn counts
+static inline void histogram_record(Histogram *h, uint64_t value) {
+    size_t i = histogram_index(value);
+    __atomic_store_n(&h->counts[i], h->counts[i] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum, h->sum + value, __ATOMIC_RELAXED);
+    if(value > h->max) __atomic_store_n(&h->max, value, __ATOMIC_RELAXED);
+}
+
+// adds the counts of a histogram, which may be recorded into at the same time
+void histogram_merge(Histogram *total, const Histogram *h) {
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++) total->counts[i] += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    total->count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    total->sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    if(max > total->max) total->max = max;
+}
+
+// the value below which the fraction of the recorded values falls
+uint64_t histogram_percentile(const Histogram *h, double fraction) {
+    unsigned long rank = fraction * h->count, seen = 0;
+    if(rank >= h->count) return h->max;
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if(seen > rank) {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < h->max ? limit : h->max;
+        }
+    }
+    return h->max;
+}
+
+// the histograms of one thread
+typedef struct LatencyRecorder LatencyRecorder;
+struct LatencyRecorder {
+    Histogram        phases[PHASE_COUNT];
+    LatencyRecorder *next;
+};
+
+LatencyRecorder         *latency_recorders = NULL;
+pthread_mutex_t          latency_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread LatencyRecorder *thread_latency = NULL;
+
+// phase_recorder recording into the histograms of the calling thread
+void latency_record(Phase phase, uint64_t ns) {
+    LatencyRecorder *recorder = thread_latency;
+    if(!recorder) {
+        recorder = thread_latency = calloc(1, sizeof(*recorder));
+        pthread_mutex_lock(&latency_lock);
+        recorder->next = latency_recorders;
+        latency_recorders = recorder;
+        pthread_mutex_unlock(&latency_lock);
+    }
+    histogram_record(&recorder->phases[phase], ns);
+}
+
+void latency_enable() {
+    phase_recorder = latency_record;
+}
+
+// the histogram of the phase over all threads so far
+void latency_snapshot(Phase phase, Histogram *total) {
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&latency_lock);
+    for(LatencyRecorder *r = latency_recorders; r; r = r->next) histogram_merge(total, &r->phases[phase]);
+    pthread_mutex_unlock(&latency_lock);
+}
+
+void histogram_print_header(FILE *file, const char *name) {
+    fprintf(file, "%-8s %10s %9s %9s %9s %9s %9s %9s\n", name, "count", "mean us", "p50", "p90", "p99", "p99.9", "max");
+}
+
+// a line of percentiles in microseconds
+void histogram_print(FILE *file, const char *name, const Histogram *h) {
+    fprintf(file, "%-8s %10lu %9.2f %9.2f %9.2f %9.2f %9.2f %9.2f\n", name, h->count,
+        h->count ? h->sum * 1e-3 / h->count : 0, histogram_percentile(h, 0.5) * 1e-3, histogram_percentile(h, 0.9) * 1e-3,
+        histogram_percentile(h, 0.99) * 1e-3, histogram_percentile(h, 0.999) * 1e-3, h->max * 1e-3);
+}
+
+// percentiles of every phase that was recorded
+void latency_print_stats(FILE *file) {
+    Histogram *h = malloc(sizeof(*h));
+    histogram_print_header(file, "phase");
+    for(int phase = 0; phase < PHASE_COUNT; phase++) {
+        latency_snapshot(phase, h);
+        if(h->count) histogram_print(file, PHASE_NAMES[phase], h);
+    }
+    free(h);
+}
+
+#endif // _HISTOGRAM_H
@@ -0,0 +1,325 @@
+// io.h
+// File input and output for the bulk modes, through io_uring when the kernel allows it
+// and plain read/write otherwise
+
+#ifndef _IO_H
+#define _IO_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "shunting.h"
+
+#define IO_DEPTH 8          // requests kept in flight
+#define IO_BLOCK (1 << 20)  // bytes per read or write request
+
+typedef struct Uring {
+    int                  fd;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned             pending; // prepared but not yet submitted
+    void                *sq_ring, *cq_ring;
+    size_t               sq_ring_size, cq_ring_size, sqes_size;
+} Uring;
+
+// set by io_init, NULL when io_uring isn't used
+Uring *io_ring = NULL;
+Uring  io_ring_storage;
+
+bool uring_init(Uring *ring, unsigned entries) {
+    struct io_uring_params params = { 0 };
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0) return false;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) return close(ring->fd), false;
+    ring->cq_ring = ring->sq_ring;
+    if(!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED) return close(ring->fd), false;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) return close(ring->fd), false;
+
+    uint8_t *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->pending = 0;
+    return true;
+}
+
+// returns a cleared submission entry, submitted with the next uring_enter
+struct io_uring_sqe *uring_sqe(Uring *ring) {
+    unsigned tail = *ring->sq_tail + ring->pending;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->pending++;
+    return sqe;
+}
+
+// submits the prepared entries and waits for at least wait completions
+void uring_enter(Uring *ring, unsigned wait) {
+    unsigned submit = ring->pending;
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->pending = 0;
+    while(syscall(__NR_io_uring_enter, ring->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0) {
+        if(errno != EINTR) die("io_uring_enter failed.\n");
+        submit = 0;
+    }
+}
+
+// takes the next completion if there is one
+bool uring_complete(Uring *ring, struct io_uring_cqe *cqe) {
+    unsigned head = *ring->cq_head;
+    if(head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return false;
+    *cqe = ring->cqes[head & *ring->cq_mask];
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// submits anything prepared and waits for the next completion
+void uring_wait(Uring *ring, struct io_uring_cqe *cqe) {
+    if(ring->pending) uring_enter(ring, 0);
+    while(!uring_complete(ring, cqe)) uring_enter(ring, 1);
+}
+
+// registers buffers for fixed reads and writes, fails when they don't fit the locked memory limit
+bool uring_register(Uring *ring, struct iovec *iov, unsigned n) {
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, n) == 0;
+}
+
+void uring_unregister(Uring *ring) {
+    syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+}
+
+// switches to io_uring if asked to and available, returns whether it is used
+bool io_init(bool use_uring) {
+    if(use_uring && !io_ring && uring_init(&io_ring_storage, 2 * IO_DEPTH)) io_ring = &io_ring_storage;
+    return io_ring;
+}
+
+// queues a read or write of part of a buffer
+void uring_prep(int opcode, int fd, char *data, size_t length, uint64_t offset, int buf_index, uint64_t user_data) {
+    struct io_uring_sqe *sqe = uring_sqe(io_ring);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)data;
+    sqe->len = length;
+    sqe->off = offset;
+    sqe->buf_index = buf_index;
+    sqe->user_data = user_data;
+}
+
+// reads the whole file into memory followed by extra zero bytes, keeping up to IO_DEPTH reads in flight.
+// the destination is registered as a fixed buffer if the locked memory limit allows it
+char *io_read_file(const char *path, size_t *size, size_t extra) {
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) die("Cannot open %s.\n", path);
+    struct stat st;
+    if(fstat(fd, &st)) die("Cannot read %s.\n", path);
+    *size = st.st_size;
+
+    char *data = malloc(*size + extra);
+    memset(data + *size, 0, extra);
+
+    if(!io_ring) {
+        for(size_t done = 0; done < *size;) {
+            ssize_t n = pread(fd, data + done, *size - done, done);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) die("Cannot read %s.\n", path);
+            done += n;
+        }
+        close(fd);
+        return data;
+    }
+
+    struct iovec iov = { data, *size };
+    bool fixed = *size && *size <= (1u << 30) && uring_register(io_ring, &iov, 1);
+
+    // the slot number of each request is its user_data
+    size_t offsets[IO_DEPTH], lengths[IO_DEPTH];
+    bool active[IO_DEPTH] = { false };
+    int opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    size_t next = 0, done = 0;
+    while(done < *size) {
+        // keep the queue full
+        for(int slot = 0; slot < IO_DEPTH && next < *size; slot++) {
+            if(active[slot]) continue;
+            offsets[slot] = next;
+            lengths[slot] = *size - next < IO_BLOCK ? *size - next : IO_BLOCK;
+            next += lengths[slot];
+            active[slot] = true;
+            uring_prep(opcode, fd, data + offsets[slot], lengths[slot], offsets[slot], 0, slot);
+        }
+
+        struct io_uring_cqe cqe;
+        uring_wait(io_ring, &cqe);
+        int slot = cqe.user_data;
+        if(cqe.res <= 0) die("Cannot read %s.\n", path);
+        done += cqe.res;
+
+        if((size_t)cqe.res < lengths[slot]) {
+            // short read, ask for the rest straight away
+            offsets[slot] += cqe.res;
+            lengths[slot] -= cqe.res;
+            uring_prep(opcode, fd, data + offsets[slot], lengths[slot], offsets[slot], 0, slot);
+        } else {
+            active[slot] = false;
+        }
+    }
+
+    if(fixed) uring_unregister(io_ring);
+    close(fd);
+    return data;
+}
+
+// buffered output, the full buffers are written out in the background through io_uring
+typedef struct IoWriter {
+    int     fd;
+    bool    seekable; // non-seekable outputs like pipes get one write at a time to keep the order
+    off_t   offset;   // where the next buffer goes in a seekable output
+    char   *buffers[IO_DEPTH];
+    bool    busy[IO_DEPTH];
+    off_t   offsets[IO_DEPTH]; // of each buffer's write in flight
+    size_t  lengths[IO_DEPTH];
+    int     current;
+    size_t  used;     // bytes in the current buffer
+    bool    fixed;    // buffers are registered
+} IoWriter;
+
+void io_writer_init(IoWriter *writer, int fd) {
+    writer->fd = fd;
+    writer->offset = lseek(fd, 0, SEEK_CUR);
+
+    // writes to an appending output ignore their offsets and land in the order they're done
+    int flags = fcntl(fd, F_GETFL);
+    writer->seekable = writer->offset >= 0 && flags >= 0 && !(flags & O_APPEND);
+    writer->current = 0;
+    writer->used = 0;
+
+    int nbuffers = io_ring ? IO_DEPTH : 1;
+    struct iovec iov[IO_DEPTH];
+    for(int i = 0; i < nbuffers; i++) {
+        writer->buffers[i] = malloc(IO_BLOCK);
+        writer->busy[i] = false;
+        iov[i].iov_base = writer->buffers[i];
+        iov[i].iov_len = IO_BLOCK;
+    }
+    writer->fixed = io_ring && uring_register(io_ring, iov, nbuffers);
+}
+
+// writes all of it with plain write calls
+void io_write_all(int fd, const char *data, size_t n, off_t offset) {
+    while(n) {
+        ssize_t written = offset >= 0 ? pwrite(fd, data, n, offset) : write(fd, data, n);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) die("Cannot write output.\n");
+        data += written;
+        n -= written;
+        if(offset >= 0) offset += written;
+    }
+}
+
+// waits for one write to finish, writing out the rest of a short write directly.
+// that keeps the order since non-seekable outputs only have one write in flight
+void io_writer_reap(IoWriter *writer) {
+    struct io_uring_cqe cqe;
+    uring_wait(io_ring, &cqe);
+    if(cqe.res < 0) die("Cannot write output.\n");
+
+    int slot = cqe.user_data;
+    size_t written = cqe.res;
+    if(written < writer->lengths[slot]) {
+        off_t offset = writer->seekable ? writer->offsets[slot] + written : -1;
+        io_write_all(writer->fd, writer->buffers[slot] + written, writer->lengths[slot] - written, offset);
+    }
+    writer->busy[slot] = false;
+}
+
+// hands the current buffer to the kernel and moves on to the next one
+void io_writer_flush(IoWriter *writer) {
+    if(!writer->used) return;
+
+    if(!io_ring) {
+        io_write_all(writer->fd, writer->buffers[0], writer->used, -1);
+        writer->used = 0;
+        return;
+    }
+
+    int slot = writer->current;
+    writer->offsets[slot] = writer->seekable ? writer->offset : -1;
+    writer->lengths[slot] = writer->used;
+    writer->busy[slot] = true;
+    uring_prep(writer->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, writer->fd, writer->buffers[slot],
+        writer->used, writer->offsets[slot], slot, slot);
+    uring_enter(io_ring, 0);
+    if(writer->seekable) writer->offset += writer->used;
+
+    // pipes and terminals only get one write at a time
+    if(!writer->seekable) while(writer->busy[slot]) io_writer_reap(writer);
+
+    writer->current = (slot + 1) % IO_DEPTH;
+    while(writer->busy[writer->current]) io_writer_reap(writer);
+    writer->used = 0;
+}
+
+void io_write(IoWriter *writer, const char *data, size_t n) {
+    while(n) {
+        size_t room = IO_BLOCK - writer->used, chunk = n < room ? n : room;
+        memcpy(writer->buffers[writer->current] + writer->used, data, chunk);
+        writer->used += chunk;
+        data += chunk;
+        n -= chunk;
+        if(writer->used == IO_BLOCK) io_writer_flush(writer);
+    }
+}
+
+void io_printf(IoWriter *writer, const char *format, ...) {
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    io_write(writer, text, n < (int)sizeof(text) ? n : sizeof(text) - 1);
+}
+
+// writes out everything and waits for it
+void io_writer_close(IoWriter *writer) {
+    io_writer_flush(writer);
+    int nbuffers = io_ring ? IO_DEPTH : 1;
+    for(int i = 0; i < nbuffers; i++) {
+        while(writer->busy[i]) io_writer_reap(writer);
+        free(writer->buffers[i]);
+    }
+    if(writer->fixed) uring_unregister(io_ring);
+
+    // writes at offsets leave the file position alone, move it past them for whatever comes next
+    if(io_ring && writer->seekable) lseek(writer->fd, writer->offset, SEEK_SET);
+}
+
+#endif // _IO_H
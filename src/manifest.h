@@ -0,0 +1,92 @@
+// manifest.h
+// Compiles a manifest of formulas in parallel into one contiguous program store
+//
+// a manifest has one formula per line. the lines are compiled by the bulk workers, a formula
+// that doesn't compile gets its error message instead of a program and the others go on.
+// the programs are then packed into two arrays, opcodes and arguments, so the store is two
+// allocations however many formulas it holds and neighbouring programs share cache lines
+
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include "program.h"
+#include "bulk.h"
+#include "diskcache.h"
+
+typedef struct ProgramStore {
+    size_t     count;    // formulas in the manifest
+    size_t     failed;   // of which didn't compile
+    Program   *programs; // pointing into code and args, length 0 for a failed formula
+    char     **errors;   // message of each failed formula, NULL for the others
+    uint8_t   *code;
+    long long *args;
+    size_t     instructions;
+} ProgramStore;
+
+typedef struct StoreCompile {
+    ProgramStore *store;
+    DiskCache    *disk;
+} StoreCompile;
+
+// compiles one formula, keeping its error instead of exiting
+void store_compile_line(void *ctx, size_t index, char *line) {
+    StoreCompile *compile = ctx;
+    ProgramStore *store = compile->store;
+
+    jmp_buf jump;
+    die_jump = &jump;
+    if(!setjmp(jump)) {
+        program_compile_cached(&store->programs[index], line, compile->disk);
+    } else {
+        size_t n = strlen(die_message);
+        if(n && die_message[n - 1] == '\n') n--;
+        if(n && die_message[n - 1] == '.') n--;
+        store->errors[index] = strndup(die_message, n);
+        store->programs[index] = (Program){ 0 };
+    }
+    die_jump = NULL;
+}
+
+// compiles every line of the manifest on the workers. disk may be NULL
+void program_store_compile(ProgramStore *store, BulkInput *manifest, int workers, DiskCache *disk, BulkStats *stats) {
+    store->count = manifest->count;
+    store->programs = malloc(sizeof(*store->programs) * (store->count + 1));
+    store->errors = calloc(store->count + 1, sizeof(*store->errors));
+    StoreCompile compile = { store, disk };
+    bulk_run(manifest, workers, NULL, store_compile_line, &compile, stats);
+
+    // pack the programs one after the other
+    store->failed = store->instructions = 0;
+    for(size_t i = 0; i < store->count; i++) {
+        store->instructions += store->programs[i].length;
+        store->failed += store->errors[i] != NULL;
+    }
+    store->code = malloc(store->instructions + 1);
+    store->args = malloc(sizeof(*store->args) * (store->instructions + 1));
+    size_t offset = 0;
+    for(size_t i = 0; i < store->count; i++) {
+        Program *program = &store->programs[i];
+        if(store->errors[i]) continue;
+        memcpy(store->code + offset, program->code, program->length);
+        memcpy(store->args + offset, program->args, sizeof(*program->args) * program->length);
+        program_free(program);
+        program->code = store->code + offset;
+        program->args = store->args + offset;
+        offset += program->length;
+    }
+}
+
+// the program of formula i, NULL if it failed to compile
+const Program *program_store_get(ProgramStore *store, size_t i) {
+    return store->errors[i] ? NULL : &store->programs[i];
+}
+
+void program_store_free(ProgramStore *store) {
+    for(size_t i = 0; i < store->count; i++) free(store->errors[i]);
+    free(store->errors);
+    free(store->programs);
+    free(store->code);
+    free(store->args);
+}
+
+#endif // _MANIFEST_H
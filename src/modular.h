@@ -0,0 +1,135 @@
+// modular.h
+// Arithmetic modulo an odd N in Montgomery form for modular mode
+//
+// a residue x is kept as x * 2^64 mod N, so a product only needs a multiplication and a
+// Montgomery reduction instead of a division. constants are converted when compiling,
+// variables when loaded, and results once at the end of the program. exponents are the
+// exception: they are computed as plain integers and never converted
+
+#ifndef _MODULAR_H
+#define _MODULAR_H
+
+#include "shunting.h"
+#include "divide.h"
+
+typedef struct Modulus {
+    unsigned long long n;
+    unsigned long long ninv; // -1/n mod 2^64
+    unsigned long long r2;   // 2^128 mod n, converts into Montgomery form
+    unsigned long long one;  // 2^64 mod n, 1 in Montgomery form
+    Divisor            div;  // reciprocal of n, for reducing variables without a division
+} Modulus;
+
+bool    modular = false; // modular mode is on
+Modulus modulus;
+
+// x * y / 2^64 mod n for x, y < n
+static inline unsigned long long mont_mul(unsigned long long x, unsigned long long y, const Modulus *m) {
+    unsigned __int128 t = (unsigned __int128)x * y;
+    unsigned long long q = (unsigned long long)t * m->ninv;
+    unsigned long long r = (t + (unsigned __int128)q * m->n) >> 64;
+    return r >= m->n ? r - m->n : r;
+}
+
+// converts an integer to Montgomery form
+static inline unsigned long long mont_in(long long x, const Modulus *m) {
+    long long r = x - divisor_divide(&m->div, x) * (long long)m->n;
+    return mont_mul(r < 0 ? r + m->n : r, m->r2, m);
+}
+
+static inline unsigned long long mont_out(unsigned long long x, const Modulus *m) {
+    return mont_mul(x, 1, m);
+}
+
+// switches to modular mode, the modulus has to be odd for Montgomery form and below 2^63 so sums fit
+void modular_mode(const char *text) {
+    char *end;
+    long long n = strtoll(text, &end, 10);
+    if(end == text || *end || n < 3 || n % 2 == 0) die("The modulus must be an odd number from 3 to 2^63 - 1.\n");
+
+    modular = true;
+    modulus.n = n;
+    divisor_init(&modulus.div, n);
+
+    // newton iteration doubles the correct low bits of the inverse each step, from 3 for odd n
+    unsigned long long inverse = n;
+    for(int i = 0; i < 5; i++) inverse *= 2 - n * inverse;
+    modulus.ninv = -inverse;
+
+    modulus.one = -modulus.n % modulus.n;
+    modulus.r2 = (unsigned __int128)modulus.one * modulus.one % modulus.n;
+}
+
+// the operations take and return Montgomery forms. like the decimal ones they return
+// NULL or an error message, only division can fail
+static inline const char *mod_add(long long a, long long b, long long *out, const Modulus *m) {
+    unsigned long long s = (unsigned long long)a + b;
+    *out = s >= m->n ? s - m->n : s;
+    return NULL;
+}
+
+static inline const char *mod_sub(long long a, long long b, long long *out, const Modulus *m) {
+    *out = (unsigned long long)a >= (unsigned long long)b ? a - b : a + (m->n - b);
+    return NULL;
+}
+
+// b is unused, so negation fits the shape of the binary operations
+static inline const char *mod_neg(long long a, long long b, long long *out, const Modulus *m) {
+    *out = a ? m->n - a : 0;
+    return NULL;
+}
+
+static inline const char *mod_mul(long long a, long long b, long long *out, const Modulus *m) {
+    *out = mont_mul(a, b, m);
+    return NULL;
+}
+
+// the inverse of the Montgomery form a, in Montgomery form, from the extended euclidean algorithm
+static inline bool mod_inverse(long long a, unsigned long long *out, const Modulus *m) {
+    long long r0 = m->n, r1 = mont_out(a, m), s0 = 0, s1 = 1;
+    while(r1) {
+        long long q = r0 / r1, t;
+        t = r0 - q * r1; r0 = r1; r1 = t;
+        t = s0 - q * s1; s0 = s1; s1 = t;
+    }
+    if(r0 != 1) return false;
+    *out = mont_in(s0, m);
+    return true;
+}
+
+static inline const char *mod_div(long long a, long long b, long long *out, const Modulus *m) {
+    unsigned long long inverse;
+    if(!mod_inverse(b, &inverse, m)) return "Division by a non-invertible residue";
+    *out = mont_mul(a, inverse, m);
+    return NULL;
+}
+
+// unlike the other operands, the exponent b is a plain integer and not a Montgomery form, so
+// it isn't reduced mod n. a negative one raises the inverse of a
+static inline const char *mod_pow(long long a, long long b, long long *out, const Modulus *m) {
+    unsigned long long e = b, x = a, result = m->one;
+    if(b < 0) {
+        if(!mod_inverse(a, &x, m)) return "Negative power of a non-invertible residue";
+        e = -(unsigned long long)b;
+    }
+    while(e) {
+        if(e & 1) result = mont_mul(result, x, m);
+        e >>= 1;
+        if(e) x = mont_mul(x, x, m);
+    }
+    *out = result;
+    return NULL;
+}
+
+typedef const char *(*ModularOp)(long long a, long long b, long long *out, const Modulus *m);
+
+// applies the operation to n rows of a block, dying with the row of the first error
+static inline void modular_block(ModularOp op, long long *out, const long long *a, const long long *b, size_t n, size_t base) {
+    Modulus m = modulus; // a local copy stays in registers, stores to out can't change it
+    for(size_t r = 0; r < n; r++) {
+        const char *error = op(a[r], b[r], &out[r], &m);
+        if(error) die("%s in row %zu.\n", error, base + r + 1);
+    }
+}
+
+#endif // _MODULAR_H
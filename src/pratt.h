@@ -0,0 +1,149 @@
+// pratt.h
+// Pratt (precedence climbing) parser as an alternative to the shunting yard front end
+//
+// it is driven by the same PRECEDENCE and RIGHTASSOC tables and emits the same postfix form
+// for every well-formed expression, including the unary minus applying to the rest of its group.
+// malformed input is rejected while parsing instead of being left to evaluation
+
+#ifndef _PRATT_H
+#define _PRATT_H
+
+#include "shunting.h"
+
+// binary operators, unary minus and opening parentheses wait on a stack of frames for the end
+// of the expression on their right, instead of recursing, so neither nesting nor right
+// associative chains are bounded by the native stack. a frame is the token's kind with the
+// minimum precedence to restore once it's done, kept at the end of the output's arrays like
+// the operator stack of shunting_yard_buffer
+typedef struct Pratt {
+    TokenBuffer *input, *output;
+    size_t       next; // index of the next input token
+    size_t       top;  // number of frames
+} Pratt;
+
+void pratt_push_frame(Pratt *pratt, uint8_t kind, int min) {
+    size_t frame = pratt->output->capacity - ++pratt->top;
+    pratt->output->kinds[frame] = kind;
+    pratt->output->values[frame] = min;
+}
+
+// parses a number or variable, or opens the group or negation it starts, true once it has a complete operand
+bool pratt_operand(Pratt *pratt, int *min) {
+    if(pratt->next == pratt->input->length) die("Stack empty.\n");
+    uint8_t kind = pratt->input->kinds[pratt->next];
+    long long value = pratt->input->values[pratt->next++];
+
+    if(kind == KIND_NUMBER || kind == KIND_VARIABLE) {
+        token_buffer_push(pratt->output, kind, value);
+        return true;
+    }
+    if(kind != KIND_NEGATE && kind != KIND_OPEN) die(kind == KIND_CLOSE ? "Unmatched closing parenthesis.\n" : "Stack empty.\n");
+
+    // unary minus takes everything up to the end of its group, like it waits on the shunting yard stack
+    pratt_push_frame(pratt, kind, *min);
+    *min = 0;
+    return false;
+}
+
+// ends the expression of the innermost frame, false once the whole input expression is done
+bool pratt_close(Pratt *pratt, int *min) {
+    if(!pratt->top) return false;
+    size_t frame = pratt->output->capacity - pratt->top--;
+    uint8_t kind = pratt->output->kinds[frame];
+    *min = pratt->output->values[frame];
+    if(kind == KIND_OPEN) {
+        if(pratt->next == pratt->input->length) die("Unmatched opening parenthesis.\n");
+        if(pratt->input->kinds[pratt->next] != KIND_CLOSE) die("Remaining operands.\n");
+        pratt->next++;
+    } else {
+        token_buffer_push(pratt->output, kind, 0);
+    }
+    return true;
+}
+
+// parses an expression, then binary operators of at least the precedence of the frame they're in
+void pratt_expression(Pratt *pratt) {
+    int min = 0;
+    for(;;) {
+        while(!pratt_operand(pratt, &min));
+        for(;;) {
+            if(pratt->next < pratt->input->length) {
+                uint8_t kind = pratt->input->kinds[pratt->next];
+                Operator op = kind - KIND_PLUS;
+                if(IS_OPERATOR_KIND(kind) && PRECEDENCE[op] >= min) {
+
+                    // a right associative operator lets the same precedence continue its right operand
+                    pratt->next++;
+                    pratt_push_frame(pratt, kind, min);
+                    min = PRECEDENCE[op] + !RIGHTASSOC[op];
+                    break;
+                }
+            }
+            if(!pratt_close(pratt, &min)) return;
+        }
+    }
+}
+
+// converts between token buffers like shunting_yard_buffer
+void pratt_parse_buffer(TokenBuffer *input, TokenBuffer *output) {
+    Pratt pratt = { input, output, 0, 0 };
+    token_buffer_reserve(output, output->length + input->length);
+
+    pratt_expression(&pratt);
+    if(pratt.next < input->length) {
+        die(input->kinds[pratt.next] == KIND_CLOSE ? "Unmatched closing parenthesis.\n" : "Remaining operands.\n");
+    }
+}
+
+// converts between token queues like shunting_yard, by way of token buffers
+void pratt_parse(TokenQueue *input, TokenQueue *output) {
+    TokenBuffer in, out;
+    token_buffer_init(&in);
+    token_buffer_init(&out);
+
+    Token *t;
+    while(t = queue_remove(input)) {
+        long long value;
+        uint8_t kind = token_kind(t, &value);
+        token_buffer_push(&in, kind, value);
+        free(t);
+    }
+
+    pratt_parse_buffer(&in, &out);
+    for(size_t i = 0; i < out.length; i++) {
+        t = malloc(sizeof(*t));
+        token_init_kind(t, out.kinds[i], out.values[i]);
+        queue_insert(output, t);
+    }
+    token_buffer_free(&in);
+    token_buffer_free(&out);
+}
+
+// the front end converting infix to postfix, selectable at runtime
+typedef struct FrontEnd {
+    const char *name;
+    void      (*convert)(TokenQueue *input, TokenQueue *output);
+    void      (*convert_buffer)(TokenBuffer *input, TokenBuffer *output);
+} FrontEnd;
+
+static const FrontEnd FRONT_ENDS[] = {
+    { "shunting", shunting_yard, shunting_yard_buffer },
+    { "pratt",    pratt_parse,   pratt_parse_buffer   },
+};
+
+#define FRONT_END_COUNT (sizeof(FRONT_ENDS) / sizeof(*FRONT_ENDS))
+
+const FrontEnd *front_end = &FRONT_ENDS[0];
+
+// selects the front end by name
+void front_end_select(const char *name) {
+    for(size_t i = 0; i < FRONT_END_COUNT; i++) {
+        if(!strcmp(FRONT_ENDS[i].name, name)) {
+            front_end = &FRONT_ENDS[i];
+            return;
+        }
+    }
+    die("Unknown front end %s, use shunting or pratt.\n", name);
+}
+
+#endif // _PRATT_H
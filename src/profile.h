@@ -0,0 +1,165 @@
+// profile.h
+// Execution profile of evaluated programs: counts of opcodes and of opcode pairs and triples
+//
+// programs are straight-line code, so the opcodes of a program times its number of evaluations
+// are exactly the executed ones. every thread counts into its own profile, the profiles are
+// merged when dumped. a profile is written as text, one count per line:
+//   op <name> <count>
+//   pair <name> <name> <count>
+//   triple <name> <name> <name> <count>
+// and can be loaded again, adding to the counts
+
+#ifndef _PROFILE_H
+#define _PROFILE_H
+
+#include <pthread.h>
+#include "program.h"
+
+typedef struct Profile Profile;
+struct Profile {
+    unsigned long ops[OP_COUNT];
+    unsigned long pairs[OP_COUNT][OP_COUNT];
+    unsigned long triples[OP_COUNT][OP_COUNT][OP_COUNT];
+    Profile      *next; // in the list of thread profiles
+};
+
+Profile         *profiles = NULL; // one per thread that has evaluated a program
+pthread_mutex_t  profiles_lock = PTHREAD_MUTEX_INITIALIZER;
+__thread Profile *thread_profile = NULL;
+
+// program_profiler counting into the profile of the calling thread
+void profile_program(const uint8_t *code, size_t length, size_t stride, unsigned long count) {
+    Profile *profile = thread_profile;
+    if(!profile) {
+        profile = thread_profile = calloc(1, sizeof(*profile));
+        pthread_mutex_lock(&profiles_lock);
+        profile->next = profiles;
+        profiles = profile;
+        pthread_mutex_unlock(&profiles_lock);
+    }
+
+    uint8_t prev = OP_COUNT, prev2 = OP_COUNT; // none yet
+    for(size_t i = 0; i < length; i++, code += stride) {
+        uint8_t op = *code;
+        profile->ops[op] += count;
+        if(prev != OP_COUNT) profile->pairs[prev][op] += count;
+        if(prev2 != OP_COUNT) profile->triples[prev2][prev][op] += count;
+        prev2 = prev;
+        prev = op;
+    }
+}
+
+void profile_enable() {
+    program_profiler = profile_program;
+}
+
+// adds up the profiles of all threads, a loaded profile can be merged in as well
+void profile_merge(Profile *total, Profile *profile) {
+    for(int a = 0; a < OP_COUNT; a++) {
+        total->ops[a] += profile->ops[a];
+        for(int b = 0; b < OP_COUNT; b++) {
+            total->pairs[a][b] += profile->pairs[a][b];
+            for(int c = 0; c < OP_COUNT; c++) total->triples[a][b][c] += profile->triples[a][b][c];
+        }
+    }
+}
+
+void profile_collect(Profile *total) {
+    memset(total, 0, sizeof(*total));
+    pthread_mutex_lock(&profiles_lock);
+    for(Profile *profile = profiles; profile; profile = profile->next) profile_merge(total, profile);
+    pthread_mutex_unlock(&profiles_lock);
+}
+
+// an n-gram of up to three opcodes and its count, for sorting
+typedef struct ProfileEntry {
+    unsigned long count;
+    int           n;
+    uint8_t       ops[3];
+} ProfileEntry;
+
+int compare_profile_entries(const void *a, const void *b) {
+    const ProfileEntry *x = a, *y = b;
+    if(x->n != y->n) return x->n - y->n;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+// lists the non-zero counts, ops then pairs then triples, each by descending count.
+// returns the number of entries, free the array
+size_t profile_entries(Profile *profile, ProfileEntry **entries) {
+    size_t count = 0, capacity = 64;
+    *entries = malloc(sizeof(**entries) * capacity);
+    for(int a = 0; a < OP_COUNT; a++) {
+        for(int b = -1; b < OP_COUNT; b++) {
+            for(int c = -1; c < OP_COUNT; c++) {
+                if(b < 0 && c >= 0) break;
+                unsigned long n = b < 0 ? profile->ops[a] : c < 0 ? profile->pairs[a][b] : profile->triples[a][b][c];
+                if(!n) continue;
+                if(count == capacity) *entries = realloc(*entries, sizeof(**entries) * (capacity *= 2));
+                (*entries)[count++] = (ProfileEntry){ n, b < 0 ? 1 : c < 0 ? 2 : 3, { a, b, c } };
+            }
+        }
+    }
+    qsort(*entries, count, sizeof(**entries), compare_profile_entries);
+    return count;
+}
+
+// writes the profile, limit is the number of lines of each kind or 0 for all
+void profile_print(Profile *profile, FILE *file, size_t limit) {
+    static const char *LABELS[] = { NULL, "op", "pair", "triple" };
+    ProfileEntry *entries;
+    size_t count = profile_entries(profile, &entries), shown = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(i && entries[i].n != entries[i - 1].n) shown = 0;
+        if(limit && shown++ >= limit) continue;
+        fprintf(file, "%s", LABELS[entries[i].n]);
+        for(int k = 0; k < entries[i].n; k++) fprintf(file, " %s", OPCODE_NAMES[entries[i].ops[k]]);
+        fprintf(file, " %lu\n", entries[i].count);
+    }
+    free(entries);
+}
+
+// writes the merged profile of all threads to the file
+void profile_dump(const char *path) {
+    Profile *total = malloc(sizeof(*total));
+    profile_collect(total);
+    FILE *file = fopen(path, "w");
+    if(!file) die("Cannot write %s.\n", path);
+    profile_print(total, file, 0);
+    fclose(file);
+    free(total);
+}
+
+int opcode_by_name(const char *name) {
+    for(int op = 0; op < OP_COUNT; op++) if(!strcmp(OPCODE_NAMES[op], name)) return op;
+    return -1;
+}
+
+// adds the counts of a dumped profile
+void profile_load(Profile *profile, const char *path) {
+    FILE *file = fopen(path, "r");
+    if(!file) die("Cannot read %s.\n", path);
+
+    char line[256];
+    for(int number = 1; fgets(line, sizeof(line), file); number++) {
+        char *words[5];
+        int n = 0;
+        for(char *word = strtok(line, " \t\n"); word && n < 5; word = strtok(NULL, " \t\n")) words[n++] = word;
+        if(!n || words[0][0] == '#') continue;
+
+        int size = !strcmp(words[0], "op") ? 1 : !strcmp(words[0], "pair") ? 2 : !strcmp(words[0], "triple") ? 3 : 0;
+        if(!size || n != size + 2) die("%s:%d: invalid profile line.\n", path, number);
+        int ops[3];
+        for(int k = 0; k < size; k++) {
+            if((ops[k] = opcode_by_name(words[1 + k])) < 0) die("%s:%d: unknown opcode %s.\n", path, number, words[1 + k]);
+        }
+        unsigned long count = strtoul(words[size + 1], NULL, 10);
+
+        if(size == 1) profile->ops[ops[0]] += count;
+        else if(size == 2) profile->pairs[ops[0]][ops[1]] += count;
+        else profile->triples[ops[0]][ops[1]][ops[2]] += count;
+    }
+    fclose(file);
+}
+
+#endif // _PROFILE_H
@@ -0,0 +1,358 @@
+// program.h
+// Compiled form of a postfix expression that can be evaluated any number of times
+
+#ifndef _PROGRAM_H
+#define _PROGRAM_H
+
+#include <limits.h>
+#include <time.h>
+#include "shunting.h"
+#include "pratt.h"
+#include "decimal.h"
+#include "modular.h"
+
+// opcodes are the token kinds of the postfix form, so a converted TokenBuffer is a program as it is
+typedef enum Opcode {
+    OP_PUSH = KIND_NUMBER,   // push the argument
+    OP_ADD  = KIND_PLUS,
+    OP_SUB  = KIND_MINUS,
+    OP_MUL  = KIND_TIMES,
+    OP_DIV  = KIND_DIVIDE,
+    OP_EXP  = KIND_EXP,
+    OP_NEG  = KIND_NEGATE,   // unary minus
+    OP_VAR  = KIND_VARIABLE, // push the variable numbered by the argument
+
+    // produced by passes over compiled programs
+    OP_SHL    = KIND_CLOSE + 1, // multiply by two to the power of the argument
+    OP_SQUARE,                  // x^2
+
+    // decimal mode versions of the arithmetic, see decimal.h
+    OP_DADD,
+    OP_DSUB,
+    OP_DMUL,
+    OP_DDIV,
+    OP_DEXP,
+    OP_DNEG,
+
+    // modular mode versions, working on Montgomery forms, see modular.h
+    OP_MVAR, // push the variable converted to Montgomery form
+    OP_MADD,
+    OP_MSUB,
+    OP_MMUL,
+    OP_MDIV,
+    OP_MEXP,
+    OP_MNEG,
+    OP_MOUT, // convert the result out of Montgomery form
+
+    // superinstructions doing the work of a leaf or two and the following operator, see
+    // superinstructions.h. the argument is that of the leaf, or of both variables as a | b << 8
+    OP_PUSH_ADD,
+    OP_PUSH_SUB,
+    OP_PUSH_MUL,
+    OP_VAR_ADD,
+    OP_VAR_SUB,
+    OP_VAR_MUL,
+    OP_VAR_VAR_ADD,
+    OP_VAR_VAR_SUB,
+    OP_VAR_VAR_MUL,
+
+    OP_STORE, // fused programs only, see fused.h
+    OP_COUNT,
+} Opcode;
+
+// names of the opcodes for profiles and listings, the parentheses kinds are never opcodes
+const char *OPCODE_NAMES[OP_COUNT] = {
+    "push", "add", "sub", "mul", "div", "exp", "neg", "var", "open", "close",
+    "shl", "square",
+    "dadd", "dsub", "dmul", "ddiv", "dexp", "dneg",
+    "mvar", "madd", "msub", "mmul", "mdiv", "mexp", "mneg", "mout",
+    "push-add", "push-sub", "push-mul", "var-add", "var-sub", "var-mul", "var-var-add", "var-var-sub", "var-var-mul",
+    "store",
+};
+
+// called with the opcodes of every evaluated program when profiling, see profile.h.
+// stride is the distance in bytes between opcodes and count the number of evaluations
+typedef void (*ProgramProfiler)(const uint8_t *code, size_t length, size_t stride, unsigned long count);
+
+ProgramProfiler program_profiler = NULL;
+
+// phases whose latency is recorded when a recorder is set, see histogram.h. a phase cut short
+// by die() isn't recorded, so lex to eval only time work that completed. a server request ends
+// with its response, so failed requests are timed as well
+typedef enum Phase {
+    PHASE_LEX,     // read_input
+    PHASE_CONVERT, // front end, infix to postfix
+    PHASE_COMPILE, // program_compile and the passes
+    PHASE_EVAL,    // one program_eval, or one block range of program_eval_rows
+    PHASE_REQUEST, // a whole request or line, from arrival to result
+    PHASE_COUNT,
+} Phase;
+
+const char *PHASE_NAMES[PHASE_COUNT] = { "lex", "convert", "compile", "eval", "request" };
+
+typedef void (*PhaseRecorder)(Phase phase, uint64_t ns);
+
+PhaseRecorder phase_recorder = NULL;
+
+static inline uint64_t phase_clock() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// the clock when recording, so an unrecorded phase costs a branch and no clock reads
+static inline uint64_t phase_start() {
+    return phase_recorder ? phase_clock() : 0;
+}
+
+// records the phase that began at start and returns its end, the start of the next phase
+static inline uint64_t phase_mark(Phase phase, uint64_t start) {
+    if(!phase_recorder) return 0;
+    uint64_t now = phase_clock();
+    phase_recorder(phase, now - start);
+    return now;
+}
+
+// the instructions a superinstruction stands for, its opcode less OP_PUSH_ADD indexes the table
+typedef struct Superinstruction {
+    uint8_t op;
+    uint8_t length;
+    uint8_t sequence[3];
+} Superinstruction;
+
+static const Superinstruction SUPERINSTRUCTIONS[] = {
+    { OP_PUSH_ADD,    2, { OP_PUSH, OP_ADD } },
+    { OP_PUSH_SUB,    2, { OP_PUSH, OP_SUB } },
+    { OP_PUSH_MUL,    2, { OP_PUSH, OP_MUL } },
+    { OP_VAR_ADD,     2, { OP_VAR, OP_ADD } },
+    { OP_VAR_SUB,     2, { OP_VAR, OP_SUB } },
+    { OP_VAR_MUL,     2, { OP_VAR, OP_MUL } },
+    { OP_VAR_VAR_ADD, 3, { OP_VAR, OP_VAR, OP_ADD } },
+    { OP_VAR_VAR_SUB, 3, { OP_VAR, OP_VAR, OP_SUB } },
+    { OP_VAR_VAR_MUL, 3, { OP_VAR, OP_VAR, OP_MUL } },
+};
+
+#define SUPERINSTRUCTION_COUNT (sizeof(SUPERINSTRUCTIONS) / sizeof(*SUPERINSTRUCTIONS))
+
+#define IS_SUPER_OP(op) ((op) >= OP_PUSH_ADD && (op) <= OP_VAR_VAR_MUL)
+#define IS_LEAF_OP(op)  ((op) == OP_PUSH || (op) == OP_VAR || (op) == OP_MVAR)
+#define IS_UNARY_OP(op) ((op) == OP_NEG || (op) == OP_SHL || (op) == OP_SQUARE || (op) == OP_DNEG || \
+                         (op) == OP_MNEG || (op) == OP_MOUT)
+
+// change of the stack depth by an instruction
+int op_stack_effect(uint8_t op) {
+    if(IS_LEAF_OP(op) || (op >= OP_VAR_VAR_ADD && op <= OP_VAR_VAR_MUL)) return 1;
+    if(IS_UNARY_OP(op) || IS_SUPER_OP(op)) return 0;
+    return -1;
+}
+
+// decimal opcode of each token kind, so OP_DADD - OP_ADD etc. don't have to line up
+static const uint8_t DECIMAL_OPCODES[] = {
+    [OP_PUSH] = OP_PUSH, [OP_ADD] = OP_DADD, [OP_SUB] = OP_DSUB, [OP_MUL] = OP_DMUL,
+    [OP_DIV] = OP_DDIV, [OP_EXP] = OP_DEXP, [OP_NEG] = OP_DNEG, [OP_VAR] = OP_VAR,
+};
+
+static const uint8_t MODULAR_OPCODES[] = {
+    [OP_PUSH] = OP_PUSH, [OP_ADD] = OP_MADD, [OP_SUB] = OP_MSUB, [OP_MUL] = OP_MMUL,
+    [OP_DIV] = OP_MDIV, [OP_EXP] = OP_MEXP, [OP_NEG] = OP_MNEG, [OP_VAR] = OP_MVAR,
+};
+
+// x^2 as OP_EXP computes it: exact while x*x fits, powl beyond that
+static inline long long op_square(long long x) {
+    return x >= -3037000499LL && x <= 3037000499LL ? x * x : (long long)powl(x, 2);
+}
+
+// wrapping like the multiplication it replaces
+static inline long long op_shl(long long x, long long shift) {
+    return (long long)((unsigned long long)x << shift);
+}
+
+typedef struct Program {
+    uint8_t   *code;   // opcode of each instruction
+    long long *args;   // argument of each instruction, only used by leaves, OP_SHL and superinstructions
+    size_t     length; // number of instructions
+    size_t     depth;  // maximum stack depth reached during evaluation
+    uint32_t   vars;   // bit n is set if variable n is used
+} Program;
+
+// compiles a postfix token buffer, checking that every operator has its operands
+// so that evaluation doesn't have to. takes over the buffer's arrays
+void program_compile(Program *program, TokenBuffer *rpn) {
+    size_t depth = 0, max = 0;
+    uint32_t vars = 0;
+    for(size_t i = 0; i < rpn->length; i++) {
+        uint8_t kind = rpn->kinds[i];
+        if(kind == KIND_NUMBER || kind == KIND_VARIABLE) {
+            if(kind == KIND_VARIABLE) vars |= 1u << rpn->values[i];
+            depth++;
+        } else if(IS_OPERATOR_KIND(kind)) {
+            if(depth < 2) die("Stack empty.\n");
+            depth--;
+        } else if(kind == KIND_NEGATE) {
+            if(depth < 1) die("Stack empty.\n");
+        } else {
+            die("Unsupported token type.\n");
+        }
+        if(depth > max) max = depth;
+    }
+    if(depth == 0) die("Stack empty.\n");
+    if(depth > 1) die("Remaining operands.\n");
+
+    // in decimal mode the arithmetic works on fixed-point numbers
+    if(decimal_places >= 0) {
+        if(modular) die("Modular and decimal mode don't mix.\n");
+        for(size_t i = 0; i < rpn->length; i++) rpn->kinds[i] = DECIMAL_OPCODES[rpn->kinds[i]];
+    }
+
+    // in modular mode on Montgomery forms, constants are converted now and the result at the end.
+    // the right operands of ^ stay plain integers, computed with the plain opcodes
+    if(modular) {
+        size_t *starts = malloc(rpn->length * sizeof(*starts)); // first instruction of each operand on the stack
+        bool *plain = calloc(rpn->length, sizeof(*plain));
+        size_t top = 0;
+        for(size_t i = 0; i < rpn->length; i++) {
+            uint8_t kind = rpn->kinds[i];
+            if(kind == KIND_NUMBER || kind == KIND_VARIABLE) {
+                starts[top++] = i;
+            } else if(IS_OPERATOR_KIND(kind)) {
+                top--;
+                if(kind == KIND_EXP) memset(plain + starts[top], true, i - starts[top]);
+            }
+        }
+        for(size_t i = 0; i < rpn->length; i++) {
+            if(plain[i]) continue;
+            if(rpn->kinds[i] == OP_PUSH) rpn->values[i] = mont_in(rpn->values[i], &modulus);
+            rpn->kinds[i] = MODULAR_OPCODES[rpn->kinds[i]];
+        }
+        free(starts);
+        free(plain);
+        token_buffer_push(rpn, OP_MOUT, 0);
+    }
+
+    program->code = rpn->kinds;
+    program->args = rpn->values;
+    program->length = rpn->length;
+    program->depth = max;
+    program->vars = vars;
+    token_buffer_init(rpn);
+}
+
+// passes run over every program compiled from text, in order
+typedef void (*ProgramPass)(Program *program);
+
+#define MAX_PASSES 8
+
+ProgramPass program_passes[MAX_PASSES];
+const char *program_pass_names[MAX_PASSES]; // describe what each pass does to programs, for caches
+size_t      program_npasses = 0;
+
+void program_add_pass(ProgramPass pass, const char *name) {
+    if(program_npasses == MAX_PASSES) die("Too many program passes.\n");
+    program_pass_names[program_npasses] = name;
+    program_passes[program_npasses++] = pass;
+}
+
+// compiles an infix expression with the selected front end
+void program_compile_text(Program *program, char *expression) {
+    TokenBuffer input, output;
+    token_buffer_init(&input);
+    token_buffer_init(&output);
+
+    // when a caller survives die(), free the buffers on the way back to it
+    jmp_buf jump, *outer = die_jump;
+    if(outer) {
+        if(setjmp(jump)) {
+            die_jump = outer;
+            token_buffer_free(&input);
+            token_buffer_free(&output);
+            longjmp(*outer, 1);
+        }
+        die_jump = &jump;
+    }
+    uint64_t mark = phase_start();
+    read_input_buffer(&input, expression);
+    mark = phase_mark(PHASE_LEX, mark);
+    front_end->convert_buffer(&input, &output);
+    mark = phase_mark(PHASE_CONVERT, mark);
+    token_buffer_free(&input);
+    program_compile(program, &output);
+    die_jump = outer;
+    for(size_t i = 0; i < program_npasses; i++) program_passes[i](program);
+    phase_mark(PHASE_COMPILE, mark);
+}
+
+void program_free(Program *program) {
+    free(program->code);
+    free(program->args);
+}
+
+// dies unless all variables used by the program are bound
+void program_check_bindings(const Program *program, uint32_t bound) {
+    uint32_t missing = program->vars & ~bound;
+    if(missing) die("Unbound variable %c.\n", 'a' + __builtin_ctz(missing));
+}
+
+// executes instruction i with the stack ending below top, returns the new end of the stack
+static inline long long *program_step(const Program *program, size_t i, long long *top, const long long *vars) {
+    const char *error;
+    switch(program->code[i]) {
+        case OP_PUSH: *top++ = program->args[i];  break;
+        case OP_VAR:  *top++ = vars[program->args[i]]; break;
+        case OP_ADD:  top--; top[-1] += top[0];   break;
+        case OP_SUB:  top--; top[-1] -= top[0];   break;
+        case OP_MUL:  top--; top[-1] *= top[0];   break;
+        case OP_EXP:  top--; top[-1] = powl(top[-1], top[0]); break;
+        case OP_NEG:  top[-1] = -top[-1];         break;
+        case OP_SHL:  top[-1] = op_shl(top[-1], program->args[i]); break;
+        case OP_SQUARE: top[-1] = op_square(top[-1]); break;
+
+        case OP_DADD: top--; if((error = decimal_add(top[-1], top[0], &top[-1], &decimal_divisor, decimal_rounding))) die("%s.\n", error); break;
+        case OP_DSUB: top--; if((error = decimal_sub(top[-1], top[0], &top[-1], &decimal_divisor, decimal_rounding))) die("%s.\n", error); break;
+        case OP_DMUL: top--; if((error = decimal_mul(top[-1], top[0], &top[-1], &decimal_divisor, decimal_rounding))) die("%s.\n", error); break;
+        case OP_DDIV: top--; if((error = decimal_div(top[-1], top[0], &top[-1], &decimal_divisor, decimal_rounding))) die("%s.\n", error); break;
+        case OP_DEXP: top--; if((error = decimal_pow(top[-1], top[0], &top[-1], &decimal_divisor, decimal_rounding))) die("%s.\n", error); break;
+        case OP_DNEG: if((error = decimal_neg(top[-1], 0, &top[-1], &decimal_divisor, decimal_rounding))) die("%s.\n", error); break;
+
+        case OP_MVAR: *top++ = mont_in(vars[program->args[i]], &modulus); break;
+        case OP_MADD: top--; mod_add(top[-1], top[0], &top[-1], &modulus); break;
+        case OP_MSUB: top--; mod_sub(top[-1], top[0], &top[-1], &modulus); break;
+        case OP_MMUL: top--; mod_mul(top[-1], top[0], &top[-1], &modulus); break;
+        case OP_MEXP: top--; if((error = mod_pow(top[-1], top[0], &top[-1], &modulus))) die("%s.\n", error); break;
+        case OP_MDIV: top--; if((error = mod_div(top[-1], top[0], &top[-1], &modulus))) die("%s.\n", error); break;
+        case OP_MNEG: mod_neg(top[-1], 0, &top[-1], &modulus); break;
+        case OP_MOUT: top[-1] = mont_out(top[-1], &modulus); break;
+
+        case OP_PUSH_ADD: top[-1] += program->args[i]; break;
+        case OP_PUSH_SUB: top[-1] -= program->args[i]; break;
+        case OP_PUSH_MUL: top[-1] *= program->args[i]; break;
+        case OP_VAR_ADD:  top[-1] += vars[program->args[i]]; break;
+        case OP_VAR_SUB:  top[-1] -= vars[program->args[i]]; break;
+        case OP_VAR_MUL:  top[-1] *= vars[program->args[i]]; break;
+        case OP_VAR_VAR_ADD: *top++ = vars[program->args[i] & 0xff] + vars[program->args[i] >> 8]; break;
+        case OP_VAR_VAR_SUB: *top++ = vars[program->args[i] & 0xff] - vars[program->args[i] >> 8]; break;
+        case OP_VAR_VAR_MUL: *top++ = vars[program->args[i] & 0xff] * vars[program->args[i] >> 8]; break;
+
+        case OP_DIV:
+            top--;
+            if(top[0] == 0) die("Division by zero.\n");
+            if(top[0] == -1 && top[-1] == LLONG_MIN) die("Division overflow.\n");
+            top[-1] /= top[0];
+            break;
+
+        default: die("Unknown opcode.\n");
+    }
+    return top;
+}
+
+// evaluates the program using a stack of at least program->depth values.
+// vars holds the values of variables, see program_check_bindings
+long long program_eval(const Program *program, long long *stack, const long long *vars) {
+    long long *top = stack; // one past the top value
+    if(program_profiler) program_profiler(program->code, program->length, 1, 1);
+    uint64_t start = phase_start();
+    for(size_t i = 0; i < program->length; i++) top = program_step(program, i, top, vars);
+    phase_mark(PHASE_EVAL, start);
+    return stack[0];
+}
+
+#endif // _PROGRAM_H
@@ -0,0 +1,214 @@
+// protocol.h
+// Length-prefixed binary protocol spoken by the evaluation server
+//
+// every message is a 4-byte little-endian payload length followed by the payload.
+// a request payload is a type byte followed by the body:
+//   REQUEST_EVAL   number of bindings byte, for each binding a variable byte (a = 0)
+//                  and an 8-byte little-endian value, then the expression text
+//   REQUEST_STATS  no body
+// a response payload is a status byte followed by the body:
+//   RESPONSE_OK    8-byte little-endian result, or the statistics as text for REQUEST_STATS
+//   RESPONSE_ERROR error message
+// responses are sent in the order the requests arrived, so clients may pipeline requests
+
+#ifndef _PROTOCOL_H
+#define _PROTOCOL_H
+
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "shunting.h"
+
+#define PROTOCOL_MAX_PAYLOAD (1 << 20)
+
+typedef enum RequestType {
+    REQUEST_EVAL  = 0,
+    REQUEST_STATS = 1,
+} RequestType;
+
+typedef enum ResponseStatus {
+    RESPONSE_OK    = 0,
+    RESPONSE_ERROR = 1,
+} ResponseStatus;
+
+void put_u32(uint8_t *p, uint32_t v) {
+    for(int i = 0; i < 4; i++) p[i] = v >> (8 * i);
+}
+
+uint32_t get_u32(const uint8_t *p) {
+    uint32_t v = 0;
+    for(int i = 0; i < 4; i++) v |= (uint32_t)p[i] << (8 * i);
+    return v;
+}
+
+void put_u64(uint8_t *p, uint64_t v) {
+    for(int i = 0; i < 8; i++) p[i] = v >> (8 * i);
+}
+
+uint64_t get_u64(const uint8_t *p) {
+    uint64_t v = 0;
+    for(int i = 0; i < 8; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+// growable byte buffer, data before start has already been consumed
+typedef struct Buffer {
+    uint8_t *data;
+    size_t   start, end, capacity;
+} Buffer;
+
+void buffer_init(Buffer *buffer) {
+    buffer->data = NULL;
+    buffer->start = buffer->end = buffer->capacity = 0;
+}
+
+void buffer_free(Buffer *buffer) {
+    free(buffer->data);
+    buffer_init(buffer);
+}
+
+// makes room for at least n more bytes after end
+void buffer_reserve(Buffer *buffer, size_t n) {
+    if(buffer->start && buffer->start == buffer->end) buffer->start = buffer->end = 0;
+    if(buffer->end + n <= buffer->capacity) return;
+
+    // move the unconsumed data to the front before growing
+    if(buffer->start) {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+        buffer->end -= buffer->start;
+        buffer->start = 0;
+        if(buffer->end + n <= buffer->capacity) return;
+    }
+    while(buffer->end + n > buffer->capacity) buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 4096;
+    buffer->data = realloc(buffer->data, buffer->capacity);
+}
+
+void buffer_append(Buffer *buffer, const void *data, size_t n) {
+    buffer_reserve(buffer, n);
+    memcpy(buffer->data + buffer->end, data, n);
+    buffer->end += n;
+}
+
+// appends a message consisting of a type or status byte and a body
+void buffer_append_message(Buffer *buffer, uint8_t type, const void *body, size_t n) {
+    uint8_t header[5];
+    put_u32(header, n + 1);
+    header[4] = type;
+    buffer_append(buffer, header, sizeof(header));
+    buffer_append(buffer, body, n);
+}
+
+// appends an evaluation request
+void buffer_append_eval(Buffer *buffer, const char *text, size_t n, Bindings *vars) {
+    uint8_t body[1 + 9 * VARIABLES];
+    size_t length = 1;
+    body[0] = 0;
+    for(int v = 0; v < VARIABLES; v++) {
+        if(!(vars->bound & 1u << v)) continue;
+        body[length] = v;
+        put_u64(body + length + 1, vars->values[v]);
+        length += 9;
+        body[0]++;
+    }
+
+    uint8_t header[5];
+    put_u32(header, 1 + length + n);
+    header[4] = REQUEST_EVAL;
+    buffer_append(buffer, header, sizeof(header));
+    buffer_append(buffer, body, length);
+    buffer_append(buffer, text, n);
+}
+
+// parses the body of an evaluation request, returns false if it's malformed
+bool parse_eval(const uint8_t *body, size_t n, Bindings *vars, const char **text, size_t *length) {
+    if(n < 1 || n < 1 + 9 * (size_t)body[0]) return false;
+    bindings_init(vars);
+    for(int i = 0; i < body[0]; i++) {
+        const uint8_t *binding = body + 1 + 9 * i;
+        if(binding[0] >= VARIABLES) return false;
+        vars->values[binding[0]] = get_u64(binding + 1);
+        vars->bound |= 1u << binding[0];
+    }
+    *text = (const char *)body + 1 + 9 * body[0];
+    *length = n - 1 - 9 * body[0];
+    return true;
+}
+
+// addresses made of digits only are loopback tcp ports, anything else is a unix socket path
+bool address_is_tcp(const char *address) {
+    for(const char *c = address; *c; c++) if(!isdigit(*c)) return false;
+    return *address;
+}
+
+// creates a socket bound to the address, or connected to it
+int protocol_socket(const char *address, bool listening) {
+    int fd;
+    if(address_is_tcp(address)) {
+        struct sockaddr_in in = { 0 };
+        in.sin_family = AF_INET;
+        in.sin_port = htons(atoi(address));
+        in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if(fd < 0) die("Cannot create socket.\n");
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(listening) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if(bind(fd, (struct sockaddr *)&in, sizeof(in))) die("Cannot bind to port %s.\n", address);
+        } else if(connect(fd, (struct sockaddr *)&in, sizeof(in))) {
+            die("Cannot connect to port %s.\n", address);
+        }
+    } else {
+        struct sockaddr_un un = { 0 };
+        un.sun_family = AF_UNIX;
+        if(strlen(address) >= sizeof(un.sun_path)) die("Socket path too long.\n");
+        strcpy(un.sun_path, address);
+
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if(fd < 0) die("Cannot create socket.\n");
+        if(listening) {
+            unlink(address);
+            if(bind(fd, (struct sockaddr *)&un, sizeof(un))) die("Cannot bind to %s.\n", address);
+        } else if(connect(fd, (struct sockaddr *)&un, sizeof(un))) {
+            die("Cannot connect to %s.\n", address);
+        }
+    }
+
+    if(listening && listen(fd, 128)) die("Cannot listen on %s.\n", address);
+    return fd;
+}
+
+// blocking write of the whole buffer, returns false on error
+bool write_full(int fd, const void *data, size_t n) {
+    const uint8_t *p = data;
+    while(n) {
+        ssize_t written = write(fd, p, n);
+        if(written < 0 && errno == EINTR) continue;
+        if(written <= 0) return false;
+        p += written;
+        n -= written;
+    }
+    return true;
+}
+
+// blocking read of exactly n bytes, returns false on error or end of file
+bool read_full(int fd, void *data, size_t n) {
+    uint8_t *p = data;
+    while(n) {
+        ssize_t got = read(fd, p, n);
+        if(got < 0 && errno == EINTR) continue;
+        if(got <= 0) return false;
+        p += got;
+        n -= got;
+    }
+    return true;
+}
+
+#endif // _PROTOCOL_H
@@ -0,0 +1,241 @@
+// sharedcache.h
+// Cache of compiled programs shared between threads, with lookups that never lock
+//
+// the cache is split into shards by hash, each with a lock taken only by inserts. lookups
+// walk the bucket chains with atomic loads, so they never wait for an insert or an eviction.
+// entries unlinked by an eviction are freed once no reader can still see them: a reader
+// announces the epoch it started in, and an entry retired in epoch e waits until every
+// reader inside a lookup started after e. eviction is CLOCK, readers only set a flag on a hit
+
+#ifndef _SHAREDCACHE_H
+#define _SHAREDCACHE_H
+
+#include <pthread.h>
+#include "cache.h"
+
+#define CACHE_SHARDS 16 // power of two, chosen by the top bits of the hash
+
+typedef struct SharedEntry SharedEntry;
+struct SharedEntry {
+    char        *text;       // expression, null-terminated
+    size_t       length;
+    uint64_t     hash;
+    Program      program;
+    SharedEntry *chain;      // next entry in the same bucket, read by lookups without the lock
+    bool         referenced; // hit since the clock hand last passed
+    SharedEntry *retired;    // next entry waiting to be freed
+    uint64_t     epoch;      // in which the entry was unlinked
+};
+
+typedef struct CacheShard {
+    pthread_mutex_t lock;     // taken by inserts only
+    SharedEntry   **buckets;
+    size_t          nbuckets; // power of two
+    SharedEntry   **clock;    // every entry, swept by the hand when evicting
+    size_t          count;
+    size_t          capacity;
+    size_t          hand;
+    SharedEntry    *retired;  // unlinked entries readers may still see
+    size_t          evictions;
+} __attribute__((aligned(64))) CacheShard;
+
+// a thread looking up programs, each on its own cache line so lookups don't share lines
+typedef struct CacheReader CacheReader;
+struct CacheReader {
+    uint64_t     epoch; // in which the current lookup started, 0 outside of lookups
+    size_t       hits, misses;
+    CacheReader *next;
+} __attribute__((aligned(64)));
+
+typedef struct SharedCache {
+    CacheShard      shards[CACHE_SHARDS];
+    uint64_t        epoch;   // advanced by every eviction, starts at 1
+    CacheReader    *readers; // only ever grows, walked without the lock
+    pthread_mutex_t readers_lock;
+} SharedCache;
+
+void shared_cache_init(SharedCache *cache, size_t capacity) {
+    size_t per_shard = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
+    if(per_shard < 1) per_shard = 1;
+    for(int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard *shard = &cache->shards[s];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->nbuckets = 4;
+        while(shard->nbuckets < per_shard) shard->nbuckets *= 2;
+        shard->buckets = calloc(shard->nbuckets, sizeof(*shard->buckets));
+        shard->clock = malloc(sizeof(*shard->clock) * per_shard);
+        shard->count = shard->hand = shard->evictions = 0;
+        shard->capacity = per_shard;
+        shard->retired = NULL;
+    }
+    cache->epoch = 1;
+    cache->readers = NULL;
+    pthread_mutex_init(&cache->readers_lock, NULL);
+}
+
+// registers a thread, which uses the returned reader for all its lookups
+CacheReader *shared_cache_reader(SharedCache *cache) {
+    CacheReader *reader = aligned_alloc(64, sizeof(*reader));
+    memset(reader, 0, sizeof(*reader));
+    pthread_mutex_lock(&cache->readers_lock);
+    reader->next = cache->readers;
+    __atomic_store_n(&cache->readers, reader, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cache->readers_lock);
+    return reader;
+}
+
+// programs returned by shared_cache_get and shared_cache_put stay valid until shared_cache_exit
+void shared_cache_enter(SharedCache *cache, CacheReader *reader) {
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&cache->epoch, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+}
+
+void shared_cache_exit(CacheReader *reader) {
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+CacheShard *shared_cache_shard(SharedCache *cache, uint64_t hash) {
+    return &cache->shards[hash >> (64 - __builtin_ctz(CACHE_SHARDS))];
+}
+
+SharedEntry *shard_find(CacheShard *shard, uint64_t hash, const char *text, size_t length) {
+    SharedEntry *e = __atomic_load_n(&shard->buckets[hash & (shard->nbuckets - 1)], __ATOMIC_ACQUIRE);
+    for(; e; e = __atomic_load_n(&e->chain, __ATOMIC_ACQUIRE)) {
+        if(e->hash == hash && e->length == length && !memcmp(e->text, text, length)) return e;
+    }
+    return NULL;
+}
+
+// returns the compiled program for the expression or NULL if it's not cached
+const Program *shared_cache_get(SharedCache *cache, CacheReader *reader, const char *text, size_t length) {
+    uint64_t hash = hash_text(text, length);
+    SharedEntry *e = shard_find(shared_cache_shard(cache, hash), hash, text, length);
+    if(!e) {
+        reader->misses++;
+        return NULL;
+    }
+    // only written when it changes, so hot entries stay shared in every reader's cache
+    if(!__atomic_load_n(&e->referenced, __ATOMIC_RELAXED)) __atomic_store_n(&e->referenced, true, __ATOMIC_RELAXED);
+    reader->hits++;
+    return &e->program;
+}
+
+void shared_entry_free(SharedEntry *entry) {
+    program_free(&entry->program);
+    free(entry->text);
+    free(entry);
+}
+
+// frees the retired entries no reader can see anymore
+void shard_reclaim(SharedCache *cache, CacheShard *shard) {
+    uint64_t oldest = UINT64_MAX;
+    for(CacheReader *r = __atomic_load_n(&cache->readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t epoch = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+        if(epoch && epoch < oldest) oldest = epoch;
+    }
+
+    SharedEntry **link = &shard->retired;
+    while(*link) {
+        SharedEntry *entry = *link;
+        if(entry->epoch < oldest) {
+            *link = entry->retired;
+            shared_entry_free(entry);
+        } else {
+            link = &entry->retired;
+        }
+    }
+}
+
+// unlinks an entry that wasn't hit since the hand last passed and returns its clock slot
+size_t shard_evict(SharedCache *cache, CacheShard *shard) {
+    for(;; shard->hand = (shard->hand + 1) % shard->count) {
+        SharedEntry *entry = shard->clock[shard->hand];
+        if(__atomic_load_n(&entry->referenced, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&entry->referenced, false, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // readers at the entry keep following its chain, which stays intact until it's freed
+        SharedEntry **link = &shard->buckets[entry->hash & (shard->nbuckets - 1)];
+        while(*link != entry) link = &(*link)->chain;
+        __atomic_store_n(link, entry->chain, __ATOMIC_RELEASE);
+
+        entry->epoch = __atomic_fetch_add(&cache->epoch, 1, __ATOMIC_SEQ_CST);
+        entry->retired = shard->retired;
+        shard->retired = entry;
+        shard->evictions++;
+
+        size_t slot = shard->hand;
+        shard->hand = (shard->hand + 1) % shard->count;
+        return slot;
+    }
+}
+
+// takes ownership of the program and returns the cached one, which is another thread's
+// if it inserted the same expression first. call it between shared_cache_enter and exit
+const Program *shared_cache_put(SharedCache *cache, const char *text, size_t length, Program *program) {
+    uint64_t hash = hash_text(text, length);
+    CacheShard *shard = shared_cache_shard(cache, hash);
+    pthread_mutex_lock(&shard->lock);
+
+    SharedEntry *entry = shard_find(shard, hash, text, length);
+    if(entry) {
+        pthread_mutex_unlock(&shard->lock);
+        program_free(program);
+        return &entry->program;
+    }
+
+    entry = malloc(sizeof(*entry));
+    entry->text = malloc(length + 1);
+    memcpy(entry->text, text, length);
+    entry->text[length] = 0;
+    entry->length = length;
+    entry->hash = hash;
+    entry->program = *program;
+    entry->referenced = false;
+
+    size_t slot = shard->count < shard->capacity ? shard->count++ : shard_evict(cache, shard);
+    shard->clock[slot] = entry;
+
+    // the entry is complete before it's published
+    SharedEntry **bucket = &shard->buckets[hash & (shard->nbuckets - 1)];
+    entry->chain = *bucket;
+    __atomic_store_n(bucket, entry, __ATOMIC_RELEASE);
+
+    if(shard->retired) shard_reclaim(cache, shard);
+    pthread_mutex_unlock(&shard->lock);
+    return &entry->program;
+}
+
+// adds up the counts of all readers and shards, exact once the readers are done
+void shared_cache_stats(SharedCache *cache, size_t *hits, size_t *misses, size_t *evictions) {
+    *hits = *misses = *evictions = 0;
+    for(CacheReader *r = __atomic_load_n(&cache->readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        *hits += r->hits;
+        *misses += r->misses;
+    }
+    for(int s = 0; s < CACHE_SHARDS; s++) *evictions += cache->shards[s].evictions;
+}
+
+// frees everything, no thread may use the cache anymore
+void shared_cache_free(SharedCache *cache) {
+    for(int s = 0; s < CACHE_SHARDS; s++) {
+        CacheShard *shard = &cache->shards[s];
+        for(size_t i = 0; i < shard->count; i++) shared_entry_free(shard->clock[i]);
+        while(shard->retired) {
+            SharedEntry *entry = shard->retired;
+            shard->retired = entry->retired;
+            shared_entry_free(entry);
+        }
+        free(shard->buckets);
+        free(shard->clock);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    while(cache->readers) {
+        CacheReader *reader = cache->readers;
+        cache->readers = reader->next;
+        free(reader);
+    }
+    pthread_mutex_destroy(&cache->readers_lock);
+}
+
+#endif // _SHAREDCACHE_H
@@ -3,21 +3,161 @@
 // for converting infix to postfix notation
 
 #include <stdio.h>
+#include <getopt.h>
 #include "shunting.h"
+#include "pratt.h"
+#include "bulk.h"
+#include "disasm.h"
+#include "simplify.h"
+#include "superinstructions.h"
+
+// converts a single line in bulk mode
+void convert_line(void *ctx, size_t index, char *line) {
+    TokenBuffer *outputs = ctx;
+
+    TokenBuffer input;
+    token_buffer_init(&input);
+    read_input_buffer(&input, line);
+
+    token_buffer_init(&outputs[index]);
+    front_end->convert_buffer(&input, &outputs[index]);
+    token_buffer_free(&input);
+}
 
 int main(int argc, char** argv) {
-    if(argc != 2) die("Usage: %s <expression>\n", argv[0]);
+    const char *usage = "Usage: %s <expression>\n"
+                        "       %s -b <file> [-j <threads>] [-p] [-t <topology>] [-u] [-s]\n"
+                        "       %s -D [-T <evaluations>] [-v <name>=<value>] [-O] [-S <all | profile>] [-m <odd modulus>] <expression>...\n"
+                        "the front end is chosen with -f shunting or -f pratt, -d <places> reads fixed-point decimals\n"
+                        "-D lists the compiled program, or the fused register program of several expressions,\n"
+                        "-T also times each instruction over the evaluations\n";
+    char *bulk = NULL;
+    int workers = bulk_default_workers();
+    bool stats = false;
+    bool placement = false;
+    BulkTopology topology = { 0 };
+    bool disassemble = false;
+    unsigned long evaluations = 0;
+    char *superinstructions = NULL;
+    Bindings vars;
+    bindings_init(&vars);
+    char **bindings = malloc(sizeof(*bindings) * argc); // parsed once decimal mode is known
+    int nbindings = 0;
+
+    // options come first, anything else starting with a dash is a negative expression
+    int opt;
+    while(optind < argc && is_flag(argv[optind]) && (opt = getopt(argc, argv, "b:j:pt:usf:d:DT:v:OS:m:")) != -1) {
+        switch(opt) {
+            case 'b': bulk = optarg;           break;
+            case 'j': workers = atoi(optarg);  break;
+            case 'p': placement = true;        break;
+            case 'u': io_init(true);           break;
+            case 's': stats = true;            break;
+            case 'f': front_end_select(optarg); break;
+            case 'd': decimal_mode(atoi(optarg)); break;
+            case 'D': disassemble = true;      break;
+            case 'T': evaluations = strtoul(optarg, NULL, 10); disassemble = true; break;
+            case 'v': bindings[nbindings++] = optarg; break;
+            case 'O': program_add_pass(program_simplify, "simplify"); break;
+            case 'S': superinstructions = optarg; break;
+            case 'm': modular_mode(optarg);    break;
+
+            // simulated topology, e.g. "0-3/4-7" for two nodes with four cpus each
+            case 't':
+                bulk_topology_parse(&topology, optarg);
+                placement = true;
+                break;
+
+            default: die(usage, argv[0], argv[0], argv[0]);
+        }
+    }
+
+    for(int i = 0; i < nbindings; i++) bindings_parse(&vars, bindings[i]);
+    free(bindings);
+    if(superinstructions) superinstructions_enable(superinstructions);
+
+    // bulk mode: convert every line of the file and print the postfix forms in order
+    if(bulk) {
+        if(optind != argc) die(usage, argv[0], argv[0], argv[0]);
+
+        if(placement && !topology.nodes) bulk_topology_detect(&topology);
+
+        // workers placed on nodes first touch the pages of a mapped input, a read one stays where it was read
+        BulkInput input;
+        if(placement) bulk_read_mapped(&input, bulk);
+        else bulk_read(&input, bulk);
+
+        TokenBuffer *outputs = malloc(sizeof(*outputs) * (input.count + 1));
+        BulkStats bulk_stats;
+        bulk_run(&input, workers, placement ? &topology : NULL, convert_line, outputs, &bulk_stats);
+
+        IoWriter out;
+        io_writer_init(&out, STDOUT_FILENO);
+        for(size_t i = 0; i < input.count; i++) {
+            char buffer[32];
+            for(size_t t = 0; t < outputs[i].length; t++) {
+                io_write(&out, buffer, sprint_kind(buffer, sizeof(buffer), outputs[i].kinds[t], outputs[i].values[t]));
+            }
+            io_write(&out, "\n", 1);
+            token_buffer_free(&outputs[i]);
+        }
+        io_writer_close(&out);
+        if(stats) {
+            bulk_print_stats(&bulk_stats, stderr);
+            fprintf(stderr, "io: %s\n", !io_ring ? "mmap, write" : input.mapped ? "mmap, io_uring" : "io_uring");
+        }
+
+        free(outputs);
+        bulk_input_free(&input);
+        return 0;
+    }
+
+    // listing of what the expressions compile to
+    if(disassemble && optind < argc - 1) {
+        if(evaluations) die("Only a single expression can be timed.\n");
+        Dag dag;
+        dag_init(&dag);
+        for(int i = optind; i < argc; i++) {
+            Program program;
+            program_compile_text(&program, argv[i]);
+            dag_add_program(&dag, &program);
+            program_free(&program);
+        }
+        FusedProgram fused;
+        fused_compile(&fused, &dag);
+        fused_disassemble(&fused, stdout);
+        fused_free(&fused);
+        dag_free(&dag);
+        return 0;
+    }
+
+    if(optind != argc - 1) die(usage, argv[0], argv[0], argv[0]);
+
+    if(disassemble) {
+        Program program;
+        program_compile_text(&program, argv[optind]);
+        double *times = NULL;
+        if(evaluations) {
+            program_check_bindings(&program, vars.bound);
+            times = malloc(sizeof(*times) * program.length);
+            program_time(&program, vars.values, evaluations, times);
+        }
+        program_disassemble(&program, times, stdout);
+        free(times);
+        program_free(&program);
+        return 0;
+    }
 
     TokenQueue input;
     queue_init(&input);
-    read_input(&input, argv[1]);
+    read_input(&input, argv[optind]);
 
     printf("input:  ");
     queue_dump(&input);
 
     TokenQueue output;
     queue_init(&output);
-    shunting_yard(&input, &output);
+    front_end->convert(&input, &output);
 
     printf("output: ");
     queue_dump(&output);
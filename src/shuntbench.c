@@ -0,0 +1,142 @@
+// shuntbench.c
+// Benchmarks lexing and the infix to postfix front ends over workloads of different shapes
+//
+// every phase runs on linked token queues and on token buffers. where the kernel allows,
+// hardware counters are read around the timed loops and reported per token
+
+#include <stdio.h>
+#include <getopt.h>
+#include "shunting.h"
+#include "pratt.h"
+#include "bulk.h"
+#include "bench.h"
+
+#define CHECK_DEEP_TOKENS 300000 // tokens of the deep shapes the front ends are checked on before timing
+
+// prints a counter per token, or a dash if it isn't available
+void print_rate(PerfCounters *counters, Counter c, double tokens) {
+    if(perf_counter_available(counters, c)) printf(" %9.3f", counters->values[c] / tokens);
+    else printf(" %9s", "-");
+}
+
+// one line of results, counters per token only if any opened
+void print_phase(PerfCounters *counters, const char *shape, const char *phase, const char *layout,
+                 size_t length, double seconds, double counted) {
+    printf("%-8s %-9s %-7s %7zu %9.2f %9.1f", shape, phase, layout, length, seconds * 1e9 / length, length / seconds * 1e-6);
+    if(perf_counters_available(counters)) {
+        print_rate(counters, COUNTER_CYCLES, counted);
+        print_rate(counters, COUNTER_INSTRUCTIONS, counted);
+        if(perf_counter_available(counters, COUNTER_CYCLES) && perf_counter_available(counters, COUNTER_INSTRUCTIONS) &&
+           counters->values[COUNTER_CYCLES] > 0) {
+            printf(" %6.2f", counters->values[COUNTER_INSTRUCTIONS] / counters->values[COUNTER_CYCLES]);
+        } else {
+            printf(" %6s", "-");
+        }
+        print_rate(counters, COUNTER_BRANCH_MISSES, counted);
+        print_rate(counters, COUNTER_L1D_MISSES, counted);
+        print_rate(counters, COUNTER_LLC_MISSES, counted);
+    }
+    printf("\n");
+}
+
+// every front end has to produce the same postfix form as the first one
+void check_front_ends(TokenBuffer *input, const char *shape) {
+    TokenBuffer expected, output;
+    token_buffer_init(&expected);
+    token_buffer_init(&output);
+    FRONT_ENDS[0].convert_buffer(input, &expected);
+    for(size_t f = 0; f < FRONT_END_COUNT; f++) {
+        output.length = 0;
+        FRONT_ENDS[f].convert_buffer(input, &output);
+        if(output.length != expected.length ||
+           memcmp(output.kinds, expected.kinds, output.length) ||
+           memcmp(output.values, expected.values, sizeof(*output.values) * output.length)) {
+            die("%s differs from %s on %s.\n", FRONT_ENDS[f].name, FRONT_ENDS[0].name, shape);
+        }
+    }
+    token_buffer_free(&expected);
+    token_buffer_free(&output);
+}
+
+// checks the shapes that nest deepest at a size far past what a recursive parser could take
+void check_deep_shapes(void) {
+    static const char *deep[] = { "nested", "right" };
+    char *text = malloc(4 * CHECK_DEEP_TOKENS + 16);
+    for(size_t d = 0; d < sizeof(deep) / sizeof(*deep); d++) {
+        for(size_t s = 0; s < SHAPE_COUNT; s++) {
+            if(strcmp(SHAPES[s].name, deep[d])) continue;
+            SHAPES[s].generate(text, CHECK_DEEP_TOKENS);
+            TokenBuffer input;
+            token_buffer_init(&input);
+            read_input_buffer(&input, text);
+            check_front_ends(&input, SHAPES[s].name);
+            token_buffer_free(&input);
+        }
+    }
+    free(text);
+}
+
+int main(int argc, char** argv) {
+    const char *usage = "Usage: %s [-n <tokens per expression>] [-r <repetitions per run>] [-k <runs>] [<shape>...]\n"
+                        "shapes are flat, nested, right and random\n";
+    size_t tokens = 1000, repeat = 2000;
+    int runs = 5;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:r:k:")) != -1) {
+        switch(opt) {
+            case 'n': tokens = atol(optarg); break;
+            case 'r': repeat = atol(optarg); break;
+            case 'k': runs = atoi(optarg);   break;
+            default: die(usage, argv[0]);
+        }
+    }
+    if(tokens < 4 || repeat < 1 || runs < 1) die(usage, argv[0]);
+
+    PerfCounters counters;
+    check_deep_shapes();
+    perf_counters_open(&counters);
+    if(!perf_counters_available(&counters)) {
+        fprintf(stderr, "hardware counters unavailable (%s), timing only\n", strerror(counters.error));
+    }
+
+    char *text = malloc(4 * tokens + 16);
+    printf("%-8s %-9s %-7s %7s %9s %9s", "shape", "phase", "layout", "tokens", "ns/token", "Mtokens/s");
+    if(perf_counters_available(&counters)) {
+        printf(" %9s %9s %6s %9s %9s %9s", "cycles/t", "instr/t", "IPC", "brmiss/t", "L1dmiss/t", "LLCmiss/t");
+    }
+    printf("\n");
+    for(size_t s = 0; s < SHAPE_COUNT; s++) {
+
+        // run only the shapes named on the command line, if any
+        bool selected = optind == argc;
+        for(int i = optind; i < argc; i++) selected |= !strcmp(argv[i], SHAPES[s].name);
+        if(!selected) continue;
+
+        SHAPES[s].generate(text, tokens);
+        TokenBuffer input;
+        token_buffer_init(&input);
+        read_input_buffer(&input, text);
+        check_front_ends(&input, SHAPES[s].name);
+
+        // lexing, then every front end, each into linked queues and into buffers
+        for(int f = -1; f < (int)FRONT_END_COUNT; f++) {
+            const FrontEnd *fe = f < 0 ? NULL : &FRONT_ENDS[f];
+            for(int queues = 1; queues >= 0; queues--) {
+                perf_counters_reset(&counters);
+                double seconds = 0;
+                for(int run = 0; run < runs; run++) {
+                    double elapsed = bench_phase(fe, queues, text, &input, repeat, &counters);
+                    if(!run || elapsed < seconds) seconds = elapsed;
+                }
+                print_phase(&counters, SHAPES[s].name, fe ? fe->name : "lex", queues ? "queue" : "buffer",
+                    input.length, seconds, (double)input.length * repeat * runs);
+            }
+        }
+
+        token_buffer_free(&input);
+    }
+    perf_counters_close(&counters);
+    free(text);
+    return 0;
+}
@@ -0,0 +1,161 @@
+// shuntcachebench.c
+// Benchmarks concurrent lookups in the shared program cache against a cache behind one mutex
+//
+// every thread looks up expressions, compiling and inserting the ones that miss. most lookups
+// go to a hot set that fits the cache, the others to a large cold set, so the cache keeps
+// inserting and evicting while it's read
+
+#include <stdio.h>
+#include <getopt.h>
+#include "shunting.h"
+#include "sharedcache.h"
+#include "bulk.h"
+
+#define COLD_KEYS 100000
+
+typedef struct CacheBench {
+    char          **keys;        // hot keys first, then the cold ones
+    size_t          hot;
+    double          cold_share;  // of the lookups that go to the cold keys
+    size_t          lookups;     // per thread
+    bool            shared;
+    SharedCache     shared_cache;
+    Cache           cache;
+    pthread_mutex_t lock;        // of cache
+    pthread_barrier_t start;
+    size_t          checksum;    // keeps the lookups from being optimized away
+} CacheBench;
+
+typedef struct BenchThread {
+    pthread_t   thread;
+    CacheBench *bench;
+    uint64_t    seed;
+    double      seconds;
+} BenchThread;
+
+uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+size_t lookup_shared(CacheBench *bench, CacheReader *reader, const char *key) {
+    size_t length = strlen(key);
+    shared_cache_enter(&bench->shared_cache, reader);
+    const Program *program = shared_cache_get(&bench->shared_cache, reader, key, length);
+    if(!program) {
+        Program compiled;
+        program_compile_text(&compiled, (char *)key);
+        program = shared_cache_put(&bench->shared_cache, key, length, &compiled);
+    }
+    size_t result = program->length;
+    shared_cache_exit(reader);
+    return result;
+}
+
+size_t lookup_locked(CacheBench *bench, const char *key) {
+    size_t length = strlen(key);
+    pthread_mutex_lock(&bench->lock);
+    Program *program = cache_get(&bench->cache, key, length);
+    if(!program) {
+        Program compiled;
+        program_compile_text(&compiled, (char *)key);
+        program = cache_put(&bench->cache, key, length, &compiled);
+    }
+    size_t result = program->length;
+    pthread_mutex_unlock(&bench->lock);
+    return result;
+}
+
+void *bench_thread(void *arg) {
+    BenchThread *thread = arg;
+    CacheBench *bench = thread->bench;
+    CacheReader *reader = bench->shared ? shared_cache_reader(&bench->shared_cache) : NULL;
+    uint64_t cold_limit = bench->cold_share * UINT64_MAX;
+    size_t checksum = 0;
+
+    pthread_barrier_wait(&bench->start);
+    double start = bulk_now();
+    for(size_t i = 0; i < bench->lookups; i++) {
+        uint64_t r = next_random(&thread->seed);
+        size_t key = r < cold_limit ? bench->hot + r % COLD_KEYS : r % bench->hot;
+        checksum += bench->shared ? lookup_shared(bench, reader, bench->keys[key]) : lookup_locked(bench, bench->keys[key]);
+    }
+    thread->seconds = bulk_now() - start;
+    __atomic_fetch_add(&bench->checksum, checksum, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// runs the threads over a fresh cache, returns the lookups per second of all of them
+double bench_run(CacheBench *bench, int threads, size_t capacity, size_t *evictions) {
+    if(bench->shared) shared_cache_init(&bench->shared_cache, capacity);
+    else cache_init(&bench->cache, capacity);
+    pthread_mutex_init(&bench->lock, NULL);
+    pthread_barrier_init(&bench->start, NULL, threads);
+
+    BenchThread *workers = calloc(threads, sizeof(*workers));
+    for(int t = 0; t < threads; t++) {
+        workers[t] = (BenchThread){ .bench = bench, .seed = 0x9e3779b97f4a7c15ull * (t + 1) };
+        pthread_create(&workers[t].thread, NULL, bench_thread, &workers[t]);
+    }
+    double slowest = 0;
+    for(int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        if(workers[t].seconds > slowest) slowest = workers[t].seconds;
+    }
+
+    if(bench->shared) {
+        size_t hits, misses;
+        shared_cache_stats(&bench->shared_cache, &hits, &misses, evictions);
+        shared_cache_free(&bench->shared_cache);
+    } else {
+        *evictions = bench->cache.evictions;
+        cache_free(&bench->cache);
+    }
+    pthread_barrier_destroy(&bench->start);
+    pthread_mutex_destroy(&bench->lock);
+    free(workers);
+    return threads * bench->lookups / slowest;
+}
+
+int main(int argc, char** argv) {
+    const char *usage = "Usage: %s [-t <maximum threads>] [-c <cache entries>] [-l <lookups per thread>] [-w <cold lookups %%>]\n";
+    int max_threads = 128;
+    size_t capacity = 4096, lookups = 200000;
+    double cold = 1;
+
+    int opt;
+    while((opt = getopt(argc, argv, "t:c:l:w:")) != -1) {
+        switch(opt) {
+            case 't': max_threads = atoi(optarg); break;
+            case 'c': capacity = atol(optarg);    break;
+            case 'l': lookups = atol(optarg);     break;
+            case 'w': cold = atof(optarg);        break;
+            default: die(usage, argv[0]);
+        }
+    }
+    if(max_threads < 1 || capacity < 2 || lookups < 1 || cold < 0 || cold > 100) die(usage, argv[0]);
+
+    CacheBench bench = { .hot = capacity / 2, .cold_share = cold / 100, .lookups = lookups };
+    bench.keys = malloc(sizeof(*bench.keys) * (bench.hot + COLD_KEYS));
+    for(size_t k = 0; k < bench.hot + COLD_KEYS; k++) {
+        char key[64];
+        snprintf(key, sizeof(key), "%zu*2+%zu", k, k % 7 + 1);
+        bench.keys[k] = strdup(key);
+    }
+
+    printf("%7s %16s %16s %9s %12s\n", "threads", "shared lookups/s", "mutex lookups/s", "speedup", "evictions");
+    for(int threads = 1; threads <= max_threads; threads *= 2) {
+        size_t shared_evictions, locked_evictions;
+        bench.shared = true;
+        double shared = bench_run(&bench, threads, capacity, &shared_evictions);
+        bench.shared = false;
+        double locked = bench_run(&bench, threads, capacity, &locked_evictions);
+        printf("%7d %16.0f %16.0f %8.2fx %12zu\n", threads, shared, locked, shared / locked, shared_evictions);
+    }
+
+    for(size_t k = 0; k < bench.hot + COLD_KEYS; k++) free(bench.keys[k]);
+    free(bench.keys);
+    return bench.checksum == 0; // every program has instructions
+}
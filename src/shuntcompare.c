@@ -0,0 +1,306 @@
+// shuntcompare.c
+// Repeats the benchmarks and compares them against a stored baseline
+//
+// every sample runs each benchmark once in turn, so drift of the machine spreads over all of
+// them. a benchmark regressed when the whole 95% interval of its change lies above the
+// threshold, and then the exit status is 1
+
+#include <stdio.h>
+#include <getopt.h>
+#include "bench.h"
+#include "program.h"
+#include "stats.h"
+
+typedef struct Benchmark {
+    char            name[64];
+    const FrontEnd *fe;      // converting with it, or lexing if NULL
+    bool            queues;
+    bool            eval;    // evaluating the compiled program instead
+    char           *text;
+    TokenBuffer     input;
+    Program         program;
+    double         *samples; // ns per token
+    Summary         summary;
+} Benchmark;
+
+typedef struct Baseline {
+    size_t  tokens, repeat;
+    size_t  count;
+    char  **names;
+    Summary *summaries;
+} Baseline;
+
+// one sample of the benchmark in ns per token
+double benchmark_sample(Benchmark *b, size_t repeat) {
+    if(!b->eval) return bench_phase(b->fe, b->queues, b->text, &b->input, repeat, NULL) * 1e9 / b->input.length;
+
+    long long vars[26] = { 0 };
+    long long *stack = malloc(sizeof(*stack) * (b->program.depth + 1));
+    volatile long long sink = 0;
+    double start = bulk_now();
+    for(size_t r = 0; r < repeat; r++) sink += program_eval(&b->program, stack, vars);
+    double elapsed = bulk_now() - start;
+    free(stack);
+    return elapsed / repeat * 1e9 / b->input.length;
+}
+
+// the baseline is JSON, read back with just enough of a parser for what baseline_write writes
+void json_space(char **c) {
+    while(**c == ' ' || **c == '\n' || **c == '\r' || **c == '\t') (*c)++;
+}
+
+void json_expect(char **c, char expected, const char *path) {
+    json_space(c);
+    if(**c != expected) die("Malformed baseline %s, expected '%c'.\n", path, expected);
+    (*c)++;
+}
+
+// reads a string without escapes, which the names never need
+char *json_string(char **c, const char *path) {
+    json_expect(c, '"', path);
+    char *end = strchr(*c, '"');
+    if(!end) die("Malformed baseline %s, unterminated string.\n", path);
+    char *s = strndup(*c, end - *c);
+    *c = end + 1;
+    return s;
+}
+
+double json_number(char **c, const char *path) {
+    json_space(c);
+    char *end;
+    double value = strtod(*c, &end);
+    if(end == *c) die("Malformed baseline %s, expected a number.\n", path);
+    *c = end;
+    return value;
+}
+
+// calls field for every key of an object, which has to consume the value
+void json_object(char **c, const char *path, void (*field)(void *ctx, const char *key, char **c), void *ctx) {
+    json_expect(c, '{', path);
+    json_space(c);
+    if(**c == '}') {
+        (*c)++;
+        return;
+    }
+    for(;;) {
+        char *key = json_string(c, path);
+        json_expect(c, ':', path);
+        field(ctx, key, c);
+        free(key);
+        json_space(c);
+        if(**c == '}') break;
+        json_expect(c, ',', path);
+    }
+    (*c)++;
+}
+
+typedef struct BaselineReader {
+    Baseline   *baseline;
+    const char *path;
+} BaselineReader;
+
+void baseline_entry_field(void *ctx, const char *key, char **c) {
+    BaselineReader *reader = ctx;
+    Baseline *baseline = reader->baseline;
+    size_t i = baseline->count;
+    Summary *summary = &baseline->summaries[i];
+    if(!strcmp(key, "name")) baseline->names[i] = json_string(c, reader->path);
+    else if(!strcmp(key, "n")) summary->n = json_number(c, reader->path);
+    else if(!strcmp(key, "outliers")) summary->outliers = json_number(c, reader->path);
+    else if(!strcmp(key, "mean")) summary->mean = json_number(c, reader->path);
+    else if(!strcmp(key, "stddev")) summary->stddev = json_number(c, reader->path);
+    else if(!strcmp(key, "median")) summary->median = json_number(c, reader->path);
+    else die("Malformed baseline %s, unknown field %s.\n", reader->path, key);
+}
+
+void baseline_field(void *ctx, const char *key, char **c) {
+    BaselineReader *reader = ctx;
+    Baseline *baseline = reader->baseline;
+    if(!strcmp(key, "tokens")) baseline->tokens = json_number(c, reader->path);
+    else if(!strcmp(key, "repeat")) baseline->repeat = json_number(c, reader->path);
+    else if(!strcmp(key, "unit")) free(json_string(c, reader->path));
+    else if(!strcmp(key, "benchmarks")) {
+        json_expect(c, '[', reader->path);
+        json_space(c);
+        if(**c == ']') {
+            (*c)++;
+            return;
+        }
+        for(;;) {
+            size_t i = baseline->count;
+            baseline->names = realloc(baseline->names, sizeof(*baseline->names) * (i + 1));
+            baseline->summaries = realloc(baseline->summaries, sizeof(*baseline->summaries) * (i + 1));
+            baseline->names[i] = NULL;
+            baseline->summaries[i] = (Summary){ 0 };
+            json_object(c, reader->path, baseline_entry_field, reader);
+            if(!baseline->names[i] || !baseline->summaries[i].n) die("Malformed baseline %s, benchmark without name or samples.\n", reader->path);
+            baseline->count++;
+            json_space(c);
+            if(**c == ']') break;
+            json_expect(c, ',', reader->path);
+        }
+        (*c)++;
+    } else {
+        die("Malformed baseline %s, unknown field %s.\n", reader->path, key);
+    }
+}
+
+void baseline_read(Baseline *baseline, const char *path) {
+    FILE *file = fopen(path, "r");
+    if(!file) die("Cannot open %s.\n", path);
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = malloc(size + 1);
+    if(fread(text, 1, size, file) != (size_t)size) die("Cannot read %s.\n", path);
+    text[size] = 0;
+    fclose(file);
+
+    *baseline = (Baseline){ 0 };
+    BaselineReader reader = { baseline, path };
+    char *c = text;
+    json_object(&c, path, baseline_field, &reader);
+    free(text);
+}
+
+void baseline_write(const char *path, Benchmark *benchmarks, size_t count, size_t tokens, size_t repeat) {
+    FILE *file = fopen(path, "w");
+    if(!file) die("Cannot open %s.\n", path);
+    fprintf(file, "{\n  \"tokens\": %zu,\n  \"repeat\": %zu,\n  \"unit\": \"ns/token\",\n  \"benchmarks\": [\n", tokens, repeat);
+    for(size_t i = 0; i < count; i++) {
+        Summary *s = &benchmarks[i].summary;
+        fprintf(file, "    { \"name\": \"%s\", \"n\": %zu, \"outliers\": %zu, \"mean\": %.6g, \"stddev\": %.6g, \"median\": %.6g }%s\n",
+            benchmarks[i].name, s->n, s->outliers, s->mean, s->stddev, s->median, i + 1 < count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    if(fclose(file)) die("Cannot write %s.\n", path);
+}
+
+void baseline_free(Baseline *baseline) {
+    for(size_t i = 0; i < baseline->count; i++) free(baseline->names[i]);
+    free(baseline->names);
+    free(baseline->summaries);
+}
+
+int main(int argc, char** argv) {
+    const char *usage = "Usage: %s [-n <tokens per expression>] [-r <repetitions per sample>] [-k <samples>]\n"
+                        "          [-t <threshold percent>] [-w <baseline file>] [-c <baseline file>] [<shape>...]\n"
+                        "-w records the results as the baseline, -c compares them against it and exits with 1 if\n"
+                        "any benchmark is slower by more than the threshold with 95% confidence\n"
+                        "shapes are flat, nested, right and random\n";
+    size_t tokens = 1000, repeat = 200, nsamples = 30;
+    double threshold = 0.05; // runs on one machine drift by a few percent between them
+    char *write_path = NULL;
+    char *compare_path = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "n:r:k:t:w:c:")) != -1) {
+        switch(opt) {
+            case 'n': tokens = atol(optarg);            break;
+            case 'r': repeat = atol(optarg);            break;
+            case 'k': nsamples = atol(optarg);          break;
+            case 't': threshold = atof(optarg) / 100;   break;
+            case 'w': write_path = optarg;              break;
+            case 'c': compare_path = optarg;            break;
+            default: die(usage, argv[0]);
+        }
+    }
+    if(tokens < 4 || repeat < 1 || nsamples < 4) die(usage, argv[0]);
+
+    // read the baseline first, a mismatch shouldn't cost a whole run
+    Baseline baseline = { 0 };
+    if(compare_path) {
+        baseline_read(&baseline, compare_path);
+        if(baseline.tokens != tokens || baseline.repeat != repeat) {
+            die("%s was recorded with -n %zu -r %zu.\n", compare_path, baseline.tokens, baseline.repeat);
+        }
+    }
+
+    // lexing, every front end on queues and buffers, and evaluating, for every selected shape
+    size_t per_shape = 2 + 2 * FRONT_END_COUNT + 1;
+    Benchmark *benchmarks = calloc(SHAPE_COUNT * per_shape, sizeof(*benchmarks));
+    size_t count = 0;
+    for(size_t s = 0; s < SHAPE_COUNT; s++) {
+        bool selected = optind == argc;
+        for(int i = optind; i < argc; i++) selected |= !strcmp(argv[i], SHAPES[s].name);
+        if(!selected) continue;
+
+        char *text = malloc(4 * tokens + 16);
+        SHAPES[s].generate(text, tokens);
+        for(int f = -1; f <= (int)FRONT_END_COUNT; f++) {
+            for(int queues = 0; queues < (f < (int)FRONT_END_COUNT ? 2 : 1); queues++) {
+                Benchmark *b = &benchmarks[count++];
+                b->fe = f >= 0 && f < (int)FRONT_END_COUNT ? &FRONT_ENDS[f] : NULL;
+                b->eval = f == (int)FRONT_END_COUNT;
+                b->queues = queues;
+                b->text = text;
+                snprintf(b->name, sizeof(b->name), "%s/%s%s", SHAPES[s].name, b->eval ? "eval" : b->fe ? b->fe->name : "lex",
+                    queues ? "-queue" : "");
+                token_buffer_init(&b->input);
+                read_input_buffer(&b->input, text);
+                if(b->eval) program_compile_text(&b->program, text);
+                b->samples = malloc(sizeof(*b->samples) * nsamples);
+            }
+        }
+    }
+
+    // one sample of everything to warm up, then the samples taking turns
+    for(size_t i = 0; i < count; i++) benchmark_sample(&benchmarks[i], repeat);
+    for(size_t k = 0; k < nsamples; k++) {
+        for(size_t i = 0; i < count; i++) benchmarks[i].samples[k] = benchmark_sample(&benchmarks[i], repeat);
+    }
+    for(size_t i = 0; i < count; i++) stats_summarize(benchmarks[i].samples, nsamples, &benchmarks[i].summary);
+
+    int status = 0;
+    if(compare_path) {
+        printf("%-22s %18s %18s %8s %18s  %s\n", "benchmark", "baseline ns/token", "ns/token", "change", "95% interval", "verdict");
+    } else {
+        printf("%-22s %18s %9s %8s\n", "benchmark", "ns/token", "median", "outliers");
+    }
+    for(size_t i = 0; i < count; i++) {
+        Benchmark *b = &benchmarks[i];
+        if(!compare_path) {
+            printf("%-22s %10.3f ± %5.3f %9.3f %8zu\n", b->name, b->summary.mean, b->summary.stddev, b->summary.median, b->summary.outliers);
+            continue;
+        }
+
+        Summary *base = NULL;
+        for(size_t j = 0; j < baseline.count && !base; j++) {
+            if(!strcmp(baseline.names[j], b->name)) base = &baseline.summaries[j];
+        }
+        if(!base) {
+            printf("%-22s %18s %10.3f ± %5.3f %8s %18s  new\n", b->name, "-", b->summary.mean, b->summary.stddev, "-", "-");
+            continue;
+        }
+
+        Comparison c;
+        stats_compare(base, &b->summary, &c);
+        const char *verdict = "same";
+        if(c.low > threshold) {
+            verdict = "SLOWER";
+            status = 1;
+        } else if(c.high < -threshold) {
+            verdict = "faster";
+        }
+        char interval[32];
+        snprintf(interval, sizeof(interval), "[%+.1f%%, %+.1f%%]", c.low * 100, c.high * 100);
+        printf("%-22s %10.3f ± %5.3f %10.3f ± %5.3f %+7.1f%% %18s  %s\n", b->name, base->mean, base->stddev,
+            b->summary.mean, b->summary.stddev, c.change * 100, interval, verdict);
+    }
+
+    if(write_path) baseline_write(write_path, benchmarks, count, tokens, repeat);
+    if(compare_path && status) fprintf(stderr, "regression beyond %.1f%% against %s\n", threshold * 100, compare_path);
+
+    for(size_t i = 0; i < count; i++) {
+        Benchmark *b = &benchmarks[i];
+        if(b->eval) {
+            program_free(&b->program);
+            free(b->text); // the eval benchmark is the last of its shape
+        }
+        token_buffer_free(&b->input);
+        free(b->samples);
+    }
+    free(benchmarks);
+    baseline_free(&baseline);
+    return status;
+}
@@ -2,72 +2,338 @@
 // Evaluates converted expressions
 
 #include <stdio.h>
-#include <math.h>
+#include <getopt.h>
 #include "shunting.h"
+#include "bulk.h"
+#include "batch.h"
+#include "fused.h"
+#include "simplify.h"
+#include "profile.h"
+#include "superinstructions.h"
+#include "sharedcache.h"
+#include "diskcache.h"
+#include "manifest.h"
+#include "histogram.h"
+
+typedef struct BulkEval {
+    long long   *results;
+    Bindings    *vars;
+    SharedCache *cache; // compiled programs shared by the workers, or NULL
+    DiskCache   *disk;  // compiled programs kept across runs, or NULL
+} BulkEval;
+
+__thread CacheReader *eval_reader = NULL;
+
+// evaluates a single line in bulk mode
+void eval_line(void *ctx, size_t index, char *line) {
+    BulkEval *eval = ctx;
+    uint64_t start = phase_start();
+
+    Program compiled;
+    const Program *program = &compiled;
+    if(eval->cache) {
+        if(!eval_reader) eval_reader = shared_cache_reader(eval->cache);
+        shared_cache_enter(eval->cache, eval_reader);
+        size_t length = strlen(line);
+        if(!(program = shared_cache_get(eval->cache, eval_reader, line, length))) {
+            program_compile_cached(&compiled, line, eval->disk);
+            program = shared_cache_put(eval->cache, line, length, &compiled);
+        }
+    } else {
+        program_compile_cached(&compiled, line, eval->disk);
+    }
+    program_check_bindings(program, eval->vars->bound);
+
+    long long small[64];
+    long long *stack = program->depth <= 64 ? small : malloc(sizeof(*stack) * program->depth);
+    eval->results[index] = program_eval(program, stack, eval->vars->values);
+
+    if(stack != small) free(stack);
+    if(eval->cache) shared_cache_exit(eval_reader);
+    else program_free(&compiled);
+    phase_mark(PHASE_REQUEST, start);
+}
+
+// writes a result, with its decimals in decimal mode, followed by the separator
+void write_result(IoWriter *out, long long value, char separator) {
+    char buffer[32];
+    int length = sprint_number(buffer, sizeof(buffer) - 1, value);
+    buffer[length] = separator;
+    io_write(out, buffer, length + 1);
+}
 
 int main(int argc, char** argv) {
-    if(argc != 2) die("Usage: %s <expression>\n", argv[0]);
+    const char *usage = "Usage: %s <expression>\n"
+                        "       %s -b <file> [-j <threads>] [-p] [-t <topology>] [-C <cached programs>] [-u] [-s]\n"
+                        "       %s -c <column file> [-j <threads>] [-u] [-s] <expression>...\n"
+                        "       %s -M <manifest> [-j <threads>] [-s]\n"
+                        "variables are bound with -v <name>=<value>, the front end is chosen with -f shunting or -f pratt\n"
+                        "-O simplifies compiled programs, -s also reports the rules that fired\n"
+                        "-d <places> evaluates fixed-point decimals, rounded with -r half-even, half-up, down, floor or ceiling\n"
+                        "-m <odd modulus> evaluates modulo the modulus\n"
+                        "-P <file> writes the executed opcodes, pairs and triples of opcodes to the file\n"
+                        "-S all or -S <profile file> fuses common instruction sequences, all or those frequent in the profile\n"
+                        "-K <directory> keeps compiled programs in the directory for later runs\n"
+                        "-M compiles the formulas of the manifest, one per line, in parallel and evaluates each once\n"
+                        "-L reports latency percentiles of lexing, converting, compiling, evaluating and whole lines\n";
+    char *bulk = NULL;
+    char *manifest = NULL;
+    int workers = bulk_default_workers();
+    int threads = 1; // evaluating the rows of a column file, only with -j
+    bool stats = false;
+    bool latency = false;
+    bool simplify = false;
+    bool placement = false;
+    BulkTopology topology = { 0 };
+    char *columns_file = NULL;
+    char *profile = NULL;
+    size_t cached = 0;
+    char *disk_dir = NULL;
+    char *superinstructions = NULL;
+    Bindings vars;
+    bindings_init(&vars);
+    char **bindings = malloc(sizeof(*bindings) * argc); // parsed once decimal mode is known
+    int nbindings = 0;
 
-    TokenQueue input;
-    queue_init(&input);
-    read_input(&input, argv[1]);
+    // options come first, anything else starting with a dash is a negative expression
+    int opt;
+    while(optind < argc && is_flag(argv[optind]) && (opt = getopt(argc, argv, "b:j:pt:usc:v:f:Od:r:m:P:S:C:K:M:L")) != -1) {
+        switch(opt) {
+            case 'b': bulk = optarg;           break;
+            case 'j': threads = workers = atoi(optarg); break;
+            case 'p': placement = true;        break;
+            case 'u': io_init(true);           break;
+            case 's': stats = true;            break;
+            case 'c': columns_file = optarg;   break;
+            case 'v': bindings[nbindings++] = optarg; break;
+            case 'f': front_end_select(optarg); break;
+            case 'O': program_add_pass(program_simplify, "simplify"); simplify = true; break;
+            case 'd': decimal_mode(atoi(optarg)); break;
+            case 'r': decimal_set_rounding(optarg); break;
+            case 'm': modular_mode(optarg); break;
+            case 'P': profile = optarg; profile_enable(); break;
+            case 'S': superinstructions = optarg; break;
+            case 'C': cached = atol(optarg);    break;
+            case 'K': disk_dir = optarg;        break;
+            case 'M': manifest = optarg;        break;
+            case 'L': latency = true; latency_enable(); break;
 
-    printf("input:  ");
-    queue_dump(&input);
+            // simulated topology, e.g. "0-3/4-7" for two nodes with four cpus each
+            case 't':
+                bulk_topology_parse(&topology, optarg);
+                placement = true;
+                break;
 
-    TokenQueue output;
-    queue_init(&output);
-    shunting_yard(&input, &output);
+            default: die(usage, argv[0], argv[0], argv[0], argv[0]);
+        }
+    }
+    for(int i = 0; i < nbindings; i++) bindings_parse(&vars, bindings[i]);
+    free(bindings);
+    if(superinstructions) superinstructions_enable(superinstructions);
+    DiskCache disk;
+    if(disk_dir) disk_cache_open(&disk, disk_dir);
 
-    printf("output: ");
-    queue_dump(&output);
+    // manifest mode: compile every formula, then print the result of each or its error
+    if(manifest) {
+        if(optind != argc) die(usage, argv[0], argv[0], argv[0], argv[0]);
+
+        BulkInput input;
+        bulk_read(&input, manifest);
+        double start = bulk_now();
+        ProgramStore store;
+        BulkStats bulk_stats;
+        program_store_compile(&store, &input, workers, disk_dir ? &disk : NULL, &bulk_stats);
+        double compiled = bulk_now() - start;
 
-    TokenStack eval_stack;
-    stack_init(&eval_stack);
-
-    Token *t, *new;
-    while(t = queue_remove(&output)) {
-        if(t->type == TOKEN_NUMBER) {
-            stack_push(&eval_stack, t);
-        } else if(t->type == TOKEN_OPERATOR) {
-            Token *a, *b;
-            // remember to first pop b then a
-            if(!(b = stack_pop(&eval_stack)) || !(a = stack_pop(&eval_stack))) die("Stack empty.\n");
-
-            long long value;
-            switch(t->v_operator) {
-                case OPERATOR_PLUS:   value = a->v_number + b->v_number;      break;
-                case OPERATOR_MINUS:  value = a->v_number - b->v_number;      break;
-                case OPERATOR_TIMES:  value = a->v_number * b->v_number;      break;
-                case OPERATOR_DIVIDE: value = a->v_number / b->v_number;      break;
-                case OPERATOR_EXP:    value = powl(a->v_number, b->v_number); break;
-
-                default: die("Unknown binary operator.\n");
+        IoWriter out;
+        io_writer_init(&out, STDOUT_FILENO);
+        EvalContext ctx;
+        eval_context_init(&ctx);
+        for(size_t i = 0; i < store.count; i++) {
+            const Program *program = program_store_get(&store, i);
+            if(!program) {
+                fprintf(stderr, "line %zu: %s.\n", input.numbers[i], store.errors[i]);
+                io_write(&out, "error\n", 6);
+                continue;
             }
 
-            new = malloc(sizeof(*new));
-            token_init_number(new, value);
-            stack_push(&eval_stack, new);
-        } else if(t->type == TOKEN_UNARY) {
-            Token *a = stack_pop(&eval_stack);
+            jmp_buf jump;
+            die_jump = &jump;
+            if(!setjmp(jump)) {
+                program_check_bindings(program, vars.bound);
+                write_result(&out, program_run(program, &ctx, vars.values), '\n');
+            } else {
+                fprintf(stderr, "line %zu: %s", input.numbers[i], die_message);
+                io_write(&out, "error\n", 6);
+            }
+            die_jump = NULL;
+        }
+        io_writer_close(&out);
+        if(stats) {
+            bulk_print_stats(&bulk_stats, stderr);
+            fprintf(stderr, "manifest: %zu formulas, %zu failed, %zu instructions, compiled in %.1f ms\n",
+                store.count, store.failed, store.instructions, compiled * 1e3);
+            if(disk_dir) disk_cache_print_stats(&disk, stderr);
+        }
+
+        eval_context_free(&ctx);
+        program_store_free(&store);
+        bulk_input_free(&input);
+        if(profile) profile_dump(profile);
+        if(latency) latency_print_stats(stderr);
+        return 0;
+    }
+
+    // bulk mode: evaluate every line of the file and print the results in order
+    if(bulk) {
+        if(optind != argc) die(usage, argv[0], argv[0], argv[0], argv[0]);
+
+        if(placement && !topology.nodes) bulk_topology_detect(&topology);
 
-            long long value;
-            switch(t->v_unary) {
-                case UNARY_MINUS: value = -a->v_number; break;
+        // workers placed on nodes first touch the pages of a mapped input, a read one stays where it was read
+        BulkInput input;
+        if(placement) bulk_read_mapped(&input, bulk);
+        else bulk_read(&input, bulk);
 
-                default: die("Unknown unary operator.\n");
+        long long *results = malloc(sizeof(*results) * (input.count + 1));
+        SharedCache cache;
+        if(cached) shared_cache_init(&cache, cached);
+        BulkEval eval = { results, &vars, cached ? &cache : NULL, disk_dir ? &disk : NULL };
+        BulkStats bulk_stats;
+        bulk_run(&input, workers, placement ? &topology : NULL, eval_line, &eval, &bulk_stats);
+
+        IoWriter out;
+        io_writer_init(&out, STDOUT_FILENO);
+        for(size_t i = 0; i < input.count; i++) write_result(&out, results[i], '\n');
+        io_writer_close(&out);
+        if(stats) {
+            bulk_print_stats(&bulk_stats, stderr);
+            if(simplify) simplify_print_stats(stderr);
+            if(superinstructions) superinstructions_print(stderr);
+            if(disk_dir) disk_cache_print_stats(&disk, stderr);
+            if(cached) {
+                size_t hits, misses, evictions;
+                shared_cache_stats(&cache, &hits, &misses, &evictions);
+                fprintf(stderr, "cache hits: %zu, misses: %zu, evictions: %zu\n", hits, misses, evictions);
             }
+            fprintf(stderr, "io: %s\n", !io_ring ? "mmap, write" : input.mapped ? "mmap, io_uring" : "io_uring");
+        }
+
+        if(cached) shared_cache_free(&cache);
+        free(results);
+        bulk_input_free(&input);
+        if(profile) profile_dump(profile);
+        if(latency) latency_print_stats(stderr);
+        return 0;
+    }
+
+    // fused batch mode: evaluate several expressions in one pass over the column file,
+    // printing the results of each row on one line
+    if(columns_file && argc - optind > 1) {
+        Columns columns;
+        columns_read(&columns, columns_file);
+
+        Dag dag;
+        dag_init(&dag);
+        size_t instructions = 0;
+        for(int i = optind; i < argc; i++) {
+            Program program;
+            program_compile_cached(&program, argv[i], disk_dir ? &disk : NULL);
+            dag_add_program(&dag, &program);
+            instructions += program.length;
+            program_free(&program);
+        }
+        FusedProgram fused;
+        fused_compile(&fused, &dag);
 
-            new = malloc(sizeof(*new));
-            token_init_number(new, value);
-            stack_push(&eval_stack, new);
+        size_t outputs = fused.outputs;
+        long long **results = malloc(sizeof(*results) * outputs);
+        for(size_t f = 0; f < outputs; f++) results[f] = malloc(sizeof(**results) * (columns.rows + 1));
+        long long *scratch = malloc(sizeof(*scratch) * (fused.slots + 1) * BATCH_BLOCK);
+        fused_eval_batch(&fused, &columns, results, scratch);
+
+        IoWriter out;
+        io_writer_init(&out, STDOUT_FILENO);
+        for(size_t i = 0; i < columns.rows; i++) {
+            for(size_t f = 0; f < outputs; f++) write_result(&out, results[f][i], f + 1 < outputs ? ' ' : '\n');
+        }
+        io_writer_close(&out);
+        if(stats) {
+            fprintf(stderr, "fused: %zu formulas, %zu instructions, %zu shared nodes, %zu operations, %zu slots\n",
+                outputs, instructions, dag.count, fused.length, fused.slots);
+            if(simplify) simplify_print_stats(stderr);
         }
+
+        for(size_t f = 0; f < outputs; f++) free(results[f]);
+        free(results);
+        free(scratch);
+        fused_free(&fused);
+        dag_free(&dag);
+        columns_free(&columns);
+        if(profile) profile_dump(profile);
+        if(latency) latency_print_stats(stderr);
+        return 0;
+    }
+
+    if(optind != argc - 1) die(usage, argv[0], argv[0], argv[0], argv[0]);
+
+    // batch mode: evaluate the expression for every row of the column file
+    if(columns_file) {
+        Columns columns;
+        columns_read(&columns, columns_file);
+
+        Program program;
+        program_compile_cached(&program, argv[optind], disk_dir ? &disk : NULL);
+
+        long long *results = malloc(sizeof(*results) * (columns.rows + 1));
+        program_eval_parallel(&program, &columns, results, threads);
+        IoWriter out;
+        io_writer_init(&out, STDOUT_FILENO);
+        for(size_t i = 0; i < columns.rows; i++) write_result(&out, results[i], '\n');
+        io_writer_close(&out);
+        if(stats && simplify) simplify_print_stats(stderr);
+        if(stats && superinstructions) superinstructions_print(stderr);
+
+        free(results);
+        program_free(&program);
+        columns_free(&columns);
+        if(profile) profile_dump(profile);
+        if(latency) latency_print_stats(stderr);
+        return 0;
     }
 
-    Token *result = stack_pop(&eval_stack);
-    if(eval_stack.top) die("Remaining operands.\n");
+    TokenQueue input;
+    queue_init(&input);
+    read_input(&input, argv[optind]);
+
+    printf("input:  ");
+    queue_dump(&input);
+
+    TokenQueue output;
+    queue_init(&output);
+    front_end->convert(&input, &output);
 
-    printf("result: %d\n", result->v_number);
+    printf("output: ");
+    queue_dump(&output);
+
+    // the queue evaluator only knows plain integers, other modes go through a compiled program
+    long long result;
+    if(decimal_places >= 0 || modular) {
+        Program program;
+        program_compile_text(&program, argv[optind]);
+        program_check_bindings(&program, vars.bound);
+        long long *stack = malloc(sizeof(*stack) * program.depth);
+        result = program_eval(&program, stack, vars.values);
+        free(stack);
+        program_free(&program);
+    } else {
+        result = evaluate(&output, &vars);
+    }
+    char buffer[32];
+    sprint_number(buffer, sizeof(buffer), result);
+    printf("result: %s\n", buffer);
 
+    if(profile) profile_dump(profile);
+    if(latency) latency_print_stats(stderr);
     return 0;
 }
@@ -0,0 +1,168 @@
+// shuntgen.c
+// Writes random valid expressions, one per line, for load tests and benchmarks
+//
+// the output is made of chunks with seeds of their own, generated by the threads in parallel
+// and written in order, so it's the same whatever the number of threads
+
+#include <stdio.h>
+#include <getopt.h>
+#include "shunting.h"
+#include "generate.h"
+#include "io.h"
+#include "bulk.h"
+
+#define CHUNK_SIZE (1 << 22) // bytes of the longest expressions a chunk can hold
+
+// parses "n" or "min-max"
+void parse_range(const char *text, long *min, long *max) {
+    char *end;
+    *min = *max = strtol(text, &end, 10);
+    if(*end == '-') *max = strtol(end + 1, &end, 10);
+    if(*end || *min < 0 || *max < *min) die("Invalid range %s.\n", text);
+}
+
+// parses a size with an optional k, M or G suffix
+size_t parse_size(const char *text) {
+    char *end;
+    double size = strtod(text, &end);
+    switch(*end) {
+        case 'k': size *= 1e3; end++; break;
+        case 'M': size *= 1e6; end++; break;
+        case 'G': size *= 1e9; end++; break;
+    }
+    if(*end || size < 0) die("Invalid size %s.\n", text);
+    return size;
+}
+
+// parses operator weights like "+4-4*3/2^1", operators left out get weight 0
+void parse_weights(const char *text, unsigned weights[5]) {
+    for(int i = 0; i < 5; i++) weights[i] = 0;
+    while(*text) {
+        const char *op = memchr(OPCHARS, *text, sizeof(OPCHARS));
+        if(!op) die("Unknown operator %c.\n", *text);
+        char *end;
+        weights[op - OPCHARS] = strtoul(text + 1, &end, 10);
+        if(end == text + 1) die("Operator %c needs a weight.\n", *text);
+        text = end;
+    }
+}
+
+typedef struct Chunk {
+    pthread_t             thread;
+    const GenerateConfig *config;
+    uint64_t              seed;
+    size_t                count;    // expressions
+    size_t                capacity; // expressions the text has room for
+    char                 *text;
+    size_t                length;
+} Chunk;
+
+void *chunk_generate(void *arg) {
+    Chunk *chunk = arg;
+    Generator generator;
+    generator_init(&generator, chunk->config, chunk->seed);
+    if(!chunk->text) chunk->text = malloc(chunk->capacity * generator_max_length(chunk->config));
+    chunk->length = 0;
+    for(size_t i = 0; i < chunk->count; i++) {
+        chunk->length += generate_expression(&generator, chunk->text + chunk->length);
+        chunk->text[chunk->length++] = '\n';
+    }
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    const char *usage = "Usage: %s [-s <seed>] [-n <expressions> | -B <bytes>] [-j <threads>] [-t <tokens>[-<tokens>]]\n"
+                        "          [-D <depth>] [-o <operator weights>] [-u <percent>] [-g <percent>]\n"
+                        "          [-w <digits>[-<digits>]] [-f <fraction digits>] [-v <variables>] [-V <percent>]\n"
+                        "-n writes that many expressions, -B at least that many bytes, with a k, M or G suffix\n"
+                        "-t is the number of tokens per expression and -D the deepest nesting of parentheses\n"
+                        "-o weighs the operators, e.g. +4-4*3/2^1, and -u and -g are the percent of operands\n"
+                        "negated and parenthesized. numbers have -w digits and -f digits after the point for\n"
+                        "decimal mode, -V percent of operands are variables out of the letters of -v\n";
+    GenerateConfig config = GENERATE_DEFAULTS;
+    uint64_t seed = 1;
+    size_t count = 1, bytes = 0;
+    int threads = bulk_default_workers();
+    long min, max;
+
+    int opt;
+    while((opt = getopt(argc, argv, "s:n:B:j:t:D:o:u:g:w:f:v:V:")) != -1) {
+        switch(opt) {
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 'n': count = atol(optarg); bytes = 0;  break;
+            case 'B': bytes = parse_size(optarg);      break;
+            case 'j': threads = atoi(optarg);          break;
+            case 'D': config.max_depth = atoi(optarg); break;
+            case 'o': parse_weights(optarg, config.weights); break;
+            case 'u': config.negate = atoi(optarg);    break;
+            case 'g': config.group = atoi(optarg);     break;
+            case 'f': config.fraction = atoi(optarg);  break;
+            case 'V': config.variable_share = atoi(optarg); break;
+
+            case 't':
+                parse_range(optarg, &min, &max);
+                config.min_tokens = min;
+                config.max_tokens = max;
+                break;
+
+            case 'w':
+                parse_range(optarg, &min, &max);
+                config.min_width = min;
+                config.max_width = max;
+                break;
+
+            case 'v':
+                if(strlen(optarg) > 26 || strspn(optarg, "abcdefghijklmnopqrstuvwxyz") != strlen(optarg)) {
+                    die("Variables are the letters a to z.\n");
+                }
+                strcpy(config.variables, optarg);
+                break;
+
+            default: die(usage, argv[0]);
+        }
+    }
+    if(optind != argc || threads < 1) die(usage, argv[0]);
+
+    Generator check;
+    generator_init(&check, &config, seed); // dies on a bad configuration before any thread starts
+    IoWriter out;
+    io_writer_init(&out, STDOUT_FILENO);
+
+    // every round generates a chunk on each thread, then writes them out in order
+    size_t per_chunk = CHUNK_SIZE / generator_max_length(&config);
+    if(!per_chunk) per_chunk = 1;
+    Chunk *chunks = calloc(threads, sizeof(*chunks));
+    size_t generated = 0, written = 0, next = 0;
+    bool done = !bytes && !count;
+    while(!done) {
+        int n = 0;
+        for(; n < threads && (bytes || generated < count); n++) {
+            Chunk *chunk = &chunks[n];
+            chunk->config = &config;
+            chunk->seed = generator_stream_seed(seed, next++);
+            chunk->capacity = per_chunk;
+            chunk->count = bytes || count - generated > per_chunk ? per_chunk : count - generated;
+            generated += chunk->count;
+            if(pthread_create(&chunk->thread, NULL, chunk_generate, chunk)) die("Cannot create generator thread.\n");
+        }
+        for(int i = 0; i < n; i++) pthread_join(chunks[i].thread, NULL);
+
+        for(int i = 0; i < n && !done; i++) {
+            size_t length = chunks[i].length;
+
+            // with a byte count, the output ends with the expression reaching it
+            if(bytes && written + length >= bytes) {
+                size_t last = bytes - written - 1;
+                length = (char *)memchr(chunks[i].text + last, '\n', length - last) - chunks[i].text + 1;
+                done = true;
+            }
+            io_write(&out, chunks[i].text, length);
+            written += length;
+        }
+        if(!bytes && generated == count) done = true;
+    }
+    io_writer_close(&out);
+    for(int i = 0; i < threads; i++) free(chunks[i].text);
+    free(chunks);
+    return 0;
+}
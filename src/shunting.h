@@ -4,15 +4,30 @@
 #ifndef _SHUNTING_H
 #define _SHUNTING_H
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <math.h>
+#include <setjmp.h>
+
+// when set, die() formats the message into die_message and jumps back here instead of exiting.
+// used by long-running callers to survive bad input. program_compile_text frees what it
+// allocated, tokens of the queue based functions are leaked
+__thread jmp_buf *die_jump = NULL;
+__thread char die_message[256];
 
 // Feeds an error message to fprintf printing to stderr and exits with code 1
 void die(const char *format, ...) {
     va_list args;
 	va_start(args, format);
+    if(die_jump) {
+        vsnprintf(die_message, sizeof(die_message), format, args);
+        va_end(args);
+        longjmp(*die_jump, 1);
+    }
 	vfprintf(stderr, format, args);
 	va_end(args);
     exit(1);
@@ -23,6 +38,7 @@ typedef enum TokenType {
     TOKEN_OPERATOR,
     TOKEN_UNARY,
     TOKEN_PARENTHESIS,
+    TOKEN_VARIABLE,
 } TokenType;
 
 typedef enum Operator {
@@ -48,6 +64,8 @@ typedef enum Parenthesis {
     PARENTHESIS_CLOSE = 1, // )
 } Parenthesis;
 
+#define VARIABLES 26 // single lowercase letters, a = 0
+
 typedef struct Token Token; // declare type before definition to allow self-reference
 struct Token {
     TokenType       type;
@@ -57,6 +75,7 @@ struct Token {
         Operator    v_operator;
         Unary       v_unary;
         Parenthesis v_parenthesis;
+        int         v_variable;
     };
 };
 
@@ -84,17 +103,154 @@ void token_init_parenthesis(Token *token, Parenthesis paren) {
     token->next = NULL;
 }
 
+void token_init_variable(Token *token, int variable) {
+    token->type = TOKEN_VARIABLE;
+    token->v_variable = variable;
+    token->next = NULL;
+}
+
+// decimal mode: numbers are fixed-point with decimal_places digits after the point,
+// stored multiplied by decimal_scale. -1 places is the plain integer mode
+int       decimal_places = -1;
+long long decimal_scale  = 1;
+
+void decimal_enable(int places) {
+    if(places < 0 || places > 18) die("Decimal places must be between 0 and 18.\n");
+    decimal_places = places;
+    decimal_scale = 1;
+    for(int i = 0; i < places; i++) decimal_scale *= 10;
+}
+
+// parses a number with an optional sign, a decimal one in decimal mode, and stores the end in end.
+// decimal numbers with more places than the mode or outside the range are errors
+long long parse_number(const char *c, char **end) {
+    if(decimal_places < 0) return strtoll(c, end, 10);
+
+    const char *start = c;
+    bool negative = *c == '-';
+    if(*c == '-' || *c == '+') c++;
+
+    long long value = 0;
+    bool digits = false, overflow = false;
+    for(; '0' <= *c && *c <= '9'; c++, digits = true) {
+        overflow |= __builtin_mul_overflow(value, 10, &value) || __builtin_add_overflow(value, *c - '0', &value);
+    }
+    overflow |= __builtin_mul_overflow(value, decimal_scale, &value);
+
+    if(*c == '.') {
+        long long place = decimal_scale;
+        for(c++; '0' <= *c && *c <= '9'; c++, digits = true) {
+            if(*c != '0' && place <= 1) die("Too many decimal places in %.*s.\n", (int)(c - start + 1), start);
+            place /= 10;
+            overflow |= __builtin_add_overflow(value, (*c - '0') * place, &value);
+        }
+    }
+
+    if(!digits) {
+        *end = (char *)start;
+        return 0;
+    }
+    if(overflow) die("Number out of range: %.*s.\n", (int)(c - start), start);
+    *end = (char *)c;
+    return negative ? -value : value;
+}
+
+// writes a number without a trailing space, with its decimals in decimal mode, returns its length
+int sprint_number(char *buffer, size_t size, long long value) {
+    if(decimal_places <= 0) return snprintf(buffer, size, "%lld", value);
+    unsigned long long magnitude = value < 0 ? -(unsigned long long)value : value;
+    return snprintf(buffer, size, "%s%llu.%0*llu", value < 0 ? "-" : "", magnitude / decimal_scale,
+        decimal_places, magnitude % decimal_scale);
+}
+
+// values of variables
+typedef struct Bindings {
+    uint32_t  bound; // bit n is set if variable n has a value
+    long long values[VARIABLES];
+} Bindings;
+
+void bindings_init(Bindings *vars) {
+    vars->bound = 0;
+}
+
+// parses and applies a binding like "x=42"
+void bindings_parse(Bindings *vars, const char *binding) {
+    char *end;
+    if(binding[0] < 'a' || binding[0] > 'z' || binding[1] != '=') die("Invalid binding %s.\n", binding);
+    long long value = parse_number(binding + 2, &end);
+    if(end == binding + 2 || *end) die("Invalid binding %s.\n", binding);
+
+    vars->values[binding[0] - 'a'] = value;
+    vars->bound |= 1u << (binding[0] - 'a');
+}
+
+// kinds of tokens as stored in a TokenBuffer, each fits in a byte
+typedef enum TokenKind {
+    KIND_NUMBER   = 0,
+    KIND_PLUS     = 1, // binary operators in the same order as Operator
+    KIND_MINUS    = 2,
+    KIND_TIMES    = 3,
+    KIND_DIVIDE   = 4,
+    KIND_EXP      = 5,
+    KIND_NEGATE   = 6, // unary minus
+    KIND_VARIABLE = 7,
+    KIND_OPEN     = 8,
+    KIND_CLOSE    = 9,
+} TokenKind;
+
+#define IS_OPERATOR_KIND(kind) (KIND_PLUS <= (kind) && (kind) <= KIND_EXP)
+
+// returns the kind of the token and stores its number or variable in value
+uint8_t token_kind(Token *token, long long *value) {
+    *value = 0;
+    switch(token->type) {
+        case TOKEN_NUMBER:      *value = token->v_number; return KIND_NUMBER;
+        case TOKEN_VARIABLE:    *value = token->v_variable; return KIND_VARIABLE;
+        case TOKEN_OPERATOR:    return KIND_PLUS + token->v_operator;
+        case TOKEN_UNARY:       return KIND_NEGATE;
+        case TOKEN_PARENTHESIS: return token->v_parenthesis == PARENTHESIS_OPEN ? KIND_OPEN : KIND_CLOSE;
+    }
+    die("Unsupported token type.\n");
+    return 0;
+}
+
+void token_init_kind(Token *token, uint8_t kind, long long value) {
+    switch(kind) {
+        case KIND_NUMBER:   token_init_number(token, value);                  break;
+        case KIND_VARIABLE: token_init_variable(token, value);                break;
+        case KIND_NEGATE:   token_init_unary(token, UNARY_MINUS);             break;
+        case KIND_OPEN:     token_init_parenthesis(token, PARENTHESIS_OPEN);  break;
+        case KIND_CLOSE:    token_init_parenthesis(token, PARENTHESIS_CLOSE); break;
+        default:            token_init_operator(token, kind - KIND_PLUS);     break;
+    }
+}
+
+// writes a textual representation of a token and a space into the buffer, returns its length
+int sprint_kind(char *buffer, size_t size, uint8_t kind, long long value) {
+    switch(kind) {
+        case KIND_NUMBER: {
+            int length = sprint_number(buffer, size, value);
+            return length + snprintf(buffer + length, size > (size_t)length ? size - length : 0, " ");
+        }
+        case KIND_VARIABLE: return snprintf(buffer, size, "%c ", 'a' + (int)value);
+        case KIND_NEGATE:   return snprintf(buffer, size, "%s ", UNCHARS[UNARY_MINUS]);
+        case KIND_OPEN:     return snprintf(buffer, size, "( ");
+        case KIND_CLOSE:    return snprintf(buffer, size, ") ");
+        default:            return snprintf(buffer, size, "%c ", OPCHARS[kind - KIND_PLUS]);
+    }
+}
+
+int sprint_token(char *buffer, size_t size, Token *token) {
+    long long value;
+    uint8_t kind = token_kind(token, &value);
+    return sprint_kind(buffer, size, kind, value);
+}
+
 // prints a textual representation of the token and a space
 void print_token(Token *token) {
-    if(token->type == TOKEN_NUMBER) {
-        printf("%d ", token->v_number);
-    } else if(token->type == TOKEN_OPERATOR) {
-        printf("%c ", OPCHARS[token->v_operator]);
-    } else if(token->type == TOKEN_UNARY) {
-        printf("%s ", UNCHARS[token->v_unary]);
-    } else if(token->type == TOKEN_PARENTHESIS) {
-        printf("%c ", token->v_parenthesis == PARENTHESIS_OPEN ? '(' : ')');
-    }
+    char buffer[32];
+    sprint_token(buffer, sizeof(buffer), token);
+    fputs(buffer, stdout);
 }
 
 typedef struct TokenQueue {
@@ -128,6 +284,19 @@ Token *queue_remove(TokenQueue *queue) {
     return head;
 }
 
+// returns the number of tokens in the queue
+size_t queue_length(TokenQueue *queue) {
+    size_t n = 0;
+    for(Token *t = queue->head; t; t = t->next) n++;
+    return n;
+}
+
+// removes and frees all tokens in the queue
+void queue_free(TokenQueue *queue) {
+    Token *t;
+    while(t = queue_remove(queue)) free(t);
+}
+
 // prints out all elements of the queue
 void queue_dump(TokenQueue *queue) {
     if(!queue->head) return;
@@ -162,111 +331,171 @@ Token *stack_pop(TokenStack *stack) {
     return t;
 }
 
-// parses a single character into a token
-void parse_char(Token *t, char c) {
+// kind of a single-character token
+uint8_t char_kind(char c) {
     switch(c) {
-        case '+': token_init_operator(t, OPERATOR_PLUS);        break;
-        case '-': token_init_operator(t, OPERATOR_MINUS);       break;
-        case '*': token_init_operator(t, OPERATOR_TIMES);       break;
-        case '/': token_init_operator(t, OPERATOR_DIVIDE);      break;
-        case '^': token_init_operator(t, OPERATOR_EXP);         break;
+        case '+': return KIND_PLUS;
+        case '-': return KIND_MINUS;
+        case '*': return KIND_TIMES;
+        case '/': return KIND_DIVIDE;
+        case '^': return KIND_EXP;
 
-        case '(': token_init_parenthesis(t, PARENTHESIS_OPEN);  break;
-        case ')': token_init_parenthesis(t, PARENTHESIS_CLOSE); break;
+        case '(': return KIND_OPEN;
+        case ')': return KIND_CLOSE;
 
         default:
             die("Unexpected character.\n");
     }
+    return 0;
 }
 
-void read_input(TokenQueue *input, char *c) {
-    bool lastreadop = true;
-    long long number;
-    do {
-        if(*c == 0) break;
-
-        // minus sign
-        if(lastreadop && *c == '-') {
-            Token *t = malloc(sizeof(*t));
-            token_init_unary(t, UNARY_MINUS);
-            queue_insert(input, t);
-        }
+// reads the token starting at c into kind and value and returns a pointer to its last character.
+// lastreadop tells whether a minus is a unary one and is updated for the next token
+char *lex_token(char *c, bool *lastreadop, uint8_t *kind, long long *value) {
+    *value = 0;
+
+    // minus sign
+    if(*lastreadop && *c == '-') {
+        *kind = KIND_NEGATE;
+    }
 
-        // numbers
-        else if('0' <= *c && *c <= '9') {
-            number = 0;
+    // numbers
+    else if('0' <= *c && *c <= '9') {
+        long long number = 0;
+        if(decimal_places >= 0) {
+            number = parse_number(c, &c);
+        } else {
+            // every digit continues the number. the loop used to stop at a 0 after the first
+            // digit, so 10 lexed as the two numbers 1 0 and failed with remaining operands
             do {
                 number = number * 10 + (*c - '0');
-            } while(*(++c) && '1' <= *c && *c <= '9');
-            c--; // woah, move back a little
+            } while(*(++c) && '0' <= *c && *c <= '9');
+        }
+        c--; // woah, move back a little
 
-            Token *t = malloc(sizeof(*t));
-            token_init_number(t, number);
-            queue_insert(input, t);
+        *kind = KIND_NUMBER;
+        *value = number;
+        *lastreadop = false;
+    }
 
-            lastreadop = false;
-        }
+    // variables
+    else if('a' <= *c && *c <= 'z') {
+        *kind = KIND_VARIABLE;
+        *value = *c - 'a';
+        *lastreadop = false;
+    }
 
-        // operators, parentheses
-        else {
-            Token *t = malloc(sizeof(*t));
-            parse_char(t, *c);
-            queue_insert(input, t);
+    // operators, parentheses
+    else {
+        *kind = char_kind(*c);
+        *lastreadop = *kind != KIND_CLOSE;
+    }
 
-            if(t->type == TOKEN_OPERATOR || t->type == TOKEN_PARENTHESIS && t->v_parenthesis == PARENTHESIS_OPEN) {
-                lastreadop = true;
-            } else {
-                lastreadop = false;
-            }
+    return c;
+}
+
+void read_input(TokenQueue *input, char *c) {
+    bool lastreadop = true;
+    for(; *c; c++) {
+        uint8_t kind;
+        long long value;
+        c = lex_token(c, &lastreadop, &kind, &value);
+
+        Token *t = malloc(sizeof(*t));
+        token_init_kind(t, kind, value);
+        queue_insert(input, t);
+    }
+}
+
+#define OPSTACK_INLINE 64 // operator stack depth that fits without touching the heap
+
+// operator stack of the conversion: an inline array that only spills to the heap for deeply nested input
+typedef struct OperatorStack {
+    Token  **items;
+    size_t   top;      // number of tokens on the stack
+    size_t   capacity;
+    Token   *inline_items[OPSTACK_INLINE];
+} OperatorStack;
+
+void opstack_init(OperatorStack *stack) {
+    stack->items = stack->inline_items;
+    stack->top = 0;
+    stack->capacity = OPSTACK_INLINE;
+}
+
+// pushes a token, spilling to a heap buffer with room for all tokens left in the input when full
+void opstack_push(OperatorStack *stack, Token *token, TokenQueue *input) {
+    if(stack->top == stack->capacity) {
+        stack->capacity = stack->top + queue_length(input) + 1;
+        if(stack->items == stack->inline_items) {
+            stack->items = malloc(sizeof(*stack->items) * stack->capacity);
+            memcpy(stack->items, stack->inline_items, sizeof(stack->inline_items));
+        } else {
+            stack->items = realloc(stack->items, sizeof(*stack->items) * stack->capacity);
         }
-    } while(*(++c));
+    }
+    stack->items[stack->top++] = token;
+}
+
+// returns the top token or null
+Token *opstack_peek(OperatorStack *stack) {
+    return stack->top ? stack->items[stack->top - 1] : NULL;
+}
+
+// pops and returns the top token or null
+Token *opstack_pop(OperatorStack *stack) {
+    return stack->top ? stack->items[--stack->top] : NULL;
+}
+
+void opstack_free(OperatorStack *stack) {
+    if(stack->items != stack->inline_items) free(stack->items);
 }
 
 // applies the shunting yard algorithm moving the elements from the input queue to the output queue
 void shunting_yard(TokenQueue *input, TokenQueue *output) {
-    TokenStack stack;
-    stack_init(&stack);
+    OperatorStack stack;
+    opstack_init(&stack);
 
-    Token *last_read = NULL;
-    Token *t;
+    Token *t, *top;
     while(t = queue_remove(input)) {
 
-        // if it's a number, move it to the output queue
-        if(t->type == TOKEN_NUMBER) {
+        // if it's a number or a variable, move it to the output queue
+        if(t->type == TOKEN_NUMBER || t->type == TOKEN_VARIABLE) {
             queue_insert(output, t);
 
         // if it's an operator...
         } else if(t->type == TOKEN_OPERATOR) {
 
             // pop all operators with higher or equal precedence and left associativity from the stack to the output queue
-            while(stack.top && stack.top->type == TOKEN_OPERATOR) {
-                if(PRECEDENCE[stack.top->v_operator] > PRECEDENCE[t->v_operator] ||
-                (PRECEDENCE[stack.top->v_operator] == PRECEDENCE[t->v_operator] && !RIGHTASSOC[stack.top->v_operator])) {
-                    queue_insert(output, stack_pop(&stack));
+            while((top = opstack_peek(&stack)) && top->type == TOKEN_OPERATOR) {
+                if(PRECEDENCE[top->v_operator] > PRECEDENCE[t->v_operator] ||
+                (PRECEDENCE[top->v_operator] == PRECEDENCE[t->v_operator] && !RIGHTASSOC[top->v_operator])) {
+                    queue_insert(output, opstack_pop(&stack));
                 }
                 else break;
             }
 
             // and then push the operator onto the stack
-            stack_push(&stack, t);
+            opstack_push(&stack, t, input);
         } else if(t->type == TOKEN_PARENTHESIS) {
 
             // if it's an opening parenthesis, push it onto the stack
             if(t->v_parenthesis == PARENTHESIS_OPEN) {
-                stack_push(&stack, t);
+                opstack_push(&stack, t, input);
 
             // if it's a closing parenthesis...
             } else if(t->v_parenthesis == PARENTHESIS_CLOSE) {
-                
+
                 // pop all operators from the stack to the output queue until an opening parenthesis is found
-                while(stack.top) {
-                    if(stack.top->type == TOKEN_PARENTHESIS && stack.top->v_parenthesis == PARENTHESIS_OPEN) break;
-                    queue_insert(output, stack_pop(&stack));
+                while(top = opstack_peek(&stack)) {
+                    if(top->type == TOKEN_PARENTHESIS && top->v_parenthesis == PARENTHESIS_OPEN) break;
+                    queue_insert(output, opstack_pop(&stack));
                 }
 
                 // pop the opening parenthesis as well, discard the closing parenthesis
-                if(stack.top && stack.top->type == TOKEN_PARENTHESIS && stack.top->v_parenthesis == PARENTHESIS_OPEN) {
-                    stack_pop(&stack);
+                if(top && top->type == TOKEN_PARENTHESIS && top->v_parenthesis == PARENTHESIS_OPEN) {
+                    free(opstack_pop(&stack));
+                    free(t);
                 } else {
                     die("Unmatched closing parenthesis.\n");
                 }
@@ -274,22 +503,160 @@ void shunting_yard(TokenQueue *input, TokenQueue *output) {
 
         // unary operator -> push onto the stack
         } else if(t->type == TOKEN_UNARY) {
-            stack_push(&stack, t);
+            opstack_push(&stack, t, input);
 
         } else {
             die("Unsupported token type.\n");
         }
-
-        last_read = t;
     }
 
     // pop all remaining operators from the stack to the output queue
-    while(t = stack_pop(&stack)) {
+    while(t = opstack_pop(&stack)) {
         if(t->type == TOKEN_PARENTHESIS && t->v_parenthesis == PARENTHESIS_OPEN) {
             die("Unmatched opening parenthesis.\n");
         }
         queue_insert(output, t);
     }
+    opstack_free(&stack);
+}
+
+// struct-of-arrays token storage: scanning the kinds touches a single byte per token
+// and the payloads sit next to each other
+typedef struct TokenBuffer {
+    uint8_t   *kinds;
+    long long *values;   // number or variable of each token, 0 for the other kinds
+    size_t     length;
+    size_t     capacity;
+} TokenBuffer;
+
+void token_buffer_init(TokenBuffer *buffer) {
+    buffer->kinds = NULL;
+    buffer->values = NULL;
+    buffer->length = buffer->capacity = 0;
+}
+
+void token_buffer_free(TokenBuffer *buffer) {
+    free(buffer->kinds);
+    free(buffer->values);
+    token_buffer_init(buffer);
+}
+
+// makes room for at least n tokens in total
+void token_buffer_reserve(TokenBuffer *buffer, size_t n) {
+    if(n <= buffer->capacity) return;
+    buffer->capacity = n;
+    buffer->kinds = realloc(buffer->kinds, n);
+    buffer->values = realloc(buffer->values, sizeof(*buffer->values) * n);
+}
+
+void token_buffer_push(TokenBuffer *buffer, uint8_t kind, long long value) {
+    if(buffer->length == buffer->capacity) token_buffer_reserve(buffer, buffer->capacity ? buffer->capacity * 2 : 16);
+    buffer->kinds[buffer->length] = kind;
+    buffer->values[buffer->length] = value;
+    buffer->length++;
+}
+
+// like read_input, but into a token buffer
+void read_input_buffer(TokenBuffer *input, char *c) {
+    bool lastreadop = true;
+    for(; *c; c++) {
+        uint8_t kind;
+        long long value;
+        c = lex_token(c, &lastreadop, &kind, &value);
+        token_buffer_push(input, kind, value);
+    }
+}
+
+// like shunting_yard, but between token buffers. the operator stack only needs kinds
+void shunting_yard_buffer(TokenBuffer *input, TokenBuffer *output) {
+    token_buffer_reserve(output, output->length + input->length);
+
+    // it grows down from the end of the output. every input token is output, waiting on the
+    // stack or dropped, so the two can never meet, and nothing is allocated that die() could leak
+    uint8_t *end = output->kinds + output->capacity, *top = end;
+
+    for(size_t i = 0; i < input->length; i++) {
+        uint8_t kind = input->kinds[i];
+
+        // numbers and variables go straight to the output
+        if(kind == KIND_NUMBER || kind == KIND_VARIABLE) {
+            token_buffer_push(output, kind, input->values[i]);
+
+        // pop operators with higher precedence, or equal precedence and left associativity, then push this one
+        } else if(IS_OPERATOR_KIND(kind)) {
+            Operator op = kind - KIND_PLUS;
+            while(top < end && IS_OPERATOR_KIND(*top)) {
+                Operator other = *top - KIND_PLUS;
+                if(PRECEDENCE[other] > PRECEDENCE[op] || (PRECEDENCE[other] == PRECEDENCE[op] && !RIGHTASSOC[other])) {
+                    token_buffer_push(output, *top++, 0);
+                }
+                else break;
+            }
+            *--top = kind;
+
+        // pop operators down to the matching opening parenthesis and discard both
+        } else if(kind == KIND_CLOSE) {
+            while(top < end && *top != KIND_OPEN) token_buffer_push(output, *top++, 0);
+            if(top == end) die("Unmatched closing parenthesis.\n");
+            top++;
+
+        // opening parentheses and unary operators wait on the stack
+        } else {
+            *--top = kind;
+        }
+    }
+
+    while(top < end) {
+        if(*top == KIND_OPEN) die("Unmatched opening parenthesis.\n");
+        token_buffer_push(output, *top++, 0);
+    }
+}
+
+// evaluates a postfix queue without consuming it, vars may be NULL if there are none
+long long evaluate(TokenQueue *rpn, Bindings *vars) {
+    long long *stack = malloc(sizeof(*stack) * (queue_length(rpn) + 1));
+    size_t top = 0; // number of values on the stack
+
+    for(Token *t = rpn->head; t; t = t->next) {
+        if(t->type == TOKEN_NUMBER) {
+            stack[top++] = t->v_number;
+        } else if(t->type == TOKEN_VARIABLE) {
+            if(!vars || !(vars->bound & 1u << t->v_variable)) die("Unbound variable %c.\n", 'a' + t->v_variable);
+            stack[top++] = vars->values[t->v_variable];
+        } else if(t->type == TOKEN_OPERATOR) {
+            // remember that b is on top of a
+            if(top < 2) die("Stack empty.\n");
+            long long a = stack[top - 2], b = stack[top - 1];
+
+            long long value;
+            switch(t->v_operator) {
+                case OPERATOR_PLUS:   value = a + b;       break;
+                case OPERATOR_MINUS:  value = a - b;       break;
+                case OPERATOR_TIMES:  value = a * b;       break;
+                case OPERATOR_DIVIDE: value = a / b;       break;
+                case OPERATOR_EXP:    value = powl(a, b);  break;
+
+                default: die("Unknown binary operator.\n");
+            }
+
+            stack[--top - 1] = value;
+        } else if(t->type == TOKEN_UNARY) {
+            if(top < 1) die("Stack empty.\n");
+
+            switch(t->v_unary) {
+                case UNARY_MINUS: stack[top - 1] = -stack[top - 1]; break;
+
+                default: die("Unknown unary operator.\n");
+            }
+        }
+    }
+
+    if(top == 0) die("Stack empty.\n");
+    if(top > 1) die("Remaining operands.\n");
+
+    long long result = stack[0];
+    free(stack);
+    return result;
 }
 
 #endif // _SHUNTING_H
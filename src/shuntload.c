@@ -0,0 +1,187 @@
+// shuntload.c
+// Load generator measuring request latency against a running shuntserver
+
+#include <stdio.h>
+#include <getopt.h>
+#include "shunting.h"
+#include "protocol.h"
+#include "bulk.h"
+#include "generate.h"
+
+typedef struct Client {
+    pthread_t    thread;
+    const char  *address;
+    char       **expressions;
+    size_t       nexpressions;
+    size_t       requests;   // to send
+    size_t       depth;      // maximum requests in flight
+    double      *latencies;  // seconds, one per request
+    size_t       errors;
+    unsigned     seed;       // for random variable values
+} Client;
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// keeps up to depth requests in flight on one connection
+void *client_run(void *arg) {
+    Client *client = arg;
+    int fd = protocol_socket(client->address, false);
+    unsigned seed = client->seed;
+
+    double *sent = malloc(sizeof(*sent) * client->depth); // send times, indexed by request modulo depth
+    Buffer request;
+    buffer_init(&request);
+    uint8_t *response = malloc(PROTOCOL_MAX_PAYLOAD);
+
+    size_t nsent = 0, nreceived = 0;
+    while(nreceived < client->requests) {
+        // top up the pipeline, writing all new requests at once
+        request.start = request.end = 0;
+        while(nsent < client->requests && nsent - nreceived < client->depth) {
+            // every variable in the expression gets a fresh random value
+            char *expression = client->expressions[nsent % client->nexpressions];
+            Bindings vars;
+            bindings_init(&vars);
+            for(char *c = expression; *c; c++) {
+                if(*c < 'a' || *c > 'z') continue;
+                vars.values[*c - 'a'] = rand_r(&seed) % 1000;
+                vars.bound |= 1u << (*c - 'a');
+            }
+            buffer_append_eval(&request, expression, strlen(expression), &vars);
+            sent[nsent % client->depth] = bulk_now();
+            nsent++;
+        }
+        if(request.end && !write_full(fd, request.data, request.end)) die("Connection lost.\n");
+
+        uint8_t header[4];
+        if(!read_full(fd, header, 4)) die("Connection lost.\n");
+        uint32_t length = get_u32(header);
+        if(length < 1 || length > PROTOCOL_MAX_PAYLOAD) die("Invalid response.\n");
+        if(!read_full(fd, response, length)) die("Connection lost.\n");
+
+        client->latencies[nreceived] = bulk_now() - sent[nreceived % client->depth];
+        if(response[0] != RESPONSE_OK) client->errors++;
+        nreceived++;
+    }
+
+    close(fd);
+    free(sent);
+    free(response);
+    buffer_free(&request);
+    return NULL;
+}
+
+// asks the server for its statistics and prints them
+void print_server_stats(const char *address) {
+    int fd = protocol_socket(address, false);
+    Buffer request;
+    buffer_init(&request);
+    buffer_append_message(&request, REQUEST_STATS, NULL, 0);
+    if(!write_full(fd, request.data, request.end)) die("Connection lost.\n");
+
+    uint8_t header[4];
+    if(!read_full(fd, header, 4)) die("Connection lost.\n");
+    uint32_t length = get_u32(header);
+    if(length < 1 || length > PROTOCOL_MAX_PAYLOAD) die("Invalid response.\n");
+    uint8_t *response = malloc(length);
+    if(!read_full(fd, response, length)) die("Connection lost.\n");
+    if(response[0] != RESPONSE_OK) die("Server stats failed: %.*s\n", (int)length - 1, response + 1);
+    printf("server:\n%.*s", (int)length - 1, response + 1);
+
+    close(fd);
+    free(response);
+    buffer_free(&request);
+}
+
+int main(int argc, char** argv) {
+    const char *usage = "Usage: %s [-c <connections>] [-n <requests per connection>] [-d <pipeline depth>]\n"
+                        "          [-f <expression file>] [-g <random expressions>] [-S <seed>] [-s] <address> [<expression>...]\n"
+                        "-g adds random expressions over the variables x, y and z generated from the seed\n"
+                        "-s prints the statistics of the server after the run\n";
+    int connections = 1;
+    size_t requests = 100000, depth = 1;
+    char *file = NULL;
+    bool server_stats = false;
+    size_t generated = 0;
+    uint64_t seed = 1;
+
+    int opt;
+    while((opt = getopt(argc, argv, "c:n:d:f:g:S:s")) != -1) {
+        switch(opt) {
+            case 'c': connections = atoi(optarg); break;
+            case 'n': requests = atol(optarg);    break;
+            case 'd': depth = atol(optarg);       break;
+            case 'f': file = optarg;              break;
+            case 'g': generated = atol(optarg);   break;
+            case 'S': seed = strtoull(optarg, NULL, 10); break;
+            case 's': server_stats = true;        break;
+            default: die(usage, argv[0]);
+        }
+    }
+    if(optind >= argc || connections < 1 || depth < 1 || requests < 1) die(usage, argv[0]);
+    const char *address = argv[optind++];
+
+    // expressions from the file and the command line are sent round-robin
+    BulkInput input = { 0 };
+    if(file) {
+        bulk_read(&input, file);
+        for(size_t i = 0; i < input.count; i++) input.lines[i][input.lengths[i]] = 0;
+    }
+    size_t nexpressions = input.count + (argc - optind) + generated;
+    if(!nexpressions) die("No expressions given.\n");
+    char **expressions = malloc(sizeof(*expressions) * nexpressions);
+    for(size_t i = 0; i < input.count; i++) expressions[i] = input.lines[i];
+    for(int i = optind; i < argc; i++) expressions[input.count + i - optind] = argv[i];
+
+    // random expressions, all in one allocation
+    GenerateConfig config = GENERATE_DEFAULTS;
+    strcpy(config.variables, "xyz");
+    Generator generator;
+    generator_init(&generator, &config, seed);
+    size_t stride = generator_max_length(&config);
+    char *random = malloc(generated * stride + 1);
+    for(size_t i = 0; i < generated; i++) {
+        expressions[nexpressions - generated + i] = random + i * stride;
+        generate_expression(&generator, random + i * stride);
+    }
+
+    Client *clients = calloc(connections, sizeof(*clients));
+    double start = bulk_now();
+    for(int c = 0; c < connections; c++) {
+        clients[c].address = address;
+        clients[c].expressions = expressions;
+        clients[c].nexpressions = nexpressions;
+        clients[c].requests = requests;
+        clients[c].depth = depth;
+        clients[c].seed = c + 1;
+        clients[c].latencies = malloc(sizeof(double) * requests);
+        if(pthread_create(&clients[c].thread, NULL, client_run, &clients[c])) die("Cannot create client thread.\n");
+    }
+    for(int c = 0; c < connections; c++) pthread_join(clients[c].thread, NULL);
+    double wall = bulk_now() - start;
+
+    size_t total = requests * connections, errors = 0;
+    double *latencies = malloc(sizeof(*latencies) * total);
+    for(int c = 0; c < connections; c++) {
+        memcpy(latencies + c * requests, clients[c].latencies, sizeof(double) * requests);
+        errors += clients[c].errors;
+        free(clients[c].latencies);
+    }
+    qsort(latencies, total, sizeof(*latencies), compare_doubles);
+
+    printf("requests: %zu, errors: %zu, %.0f req/s\n", total, errors, total / wall);
+    printf("latency us: p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+        latencies[(size_t)(total * 0.5)] * 1e6, latencies[(size_t)(total * 0.99)] * 1e6,
+        latencies[(size_t)(total * 0.999)] * 1e6, latencies[total - 1] * 1e6);
+    if(server_stats) print_server_stats(address);
+
+    free(latencies);
+    free(clients);
+    free(expressions);
+    free(random);
+    if(file) bulk_input_free(&input);
+    return 0;
+}
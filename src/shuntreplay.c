@@ -0,0 +1,157 @@
+// shuntreplay.c
+// Replays a capture of evaluation requests through the parser and evaluator
+//
+// at original speed, or a multiple of it, every request is due at its captured time and its
+// latency counts from then, so falling behind shows up as latency instead of hiding it. as
+// fast as possible, the requests run back to back and the latency is just their own time
+
+#include <stdio.h>
+#include <getopt.h>
+#include "shunting.h"
+#include "bulk.h"
+#include "batch.h"
+#include "cache.h"
+#include "simplify.h"
+#include "superinstructions.h"
+#include "histogram.h"
+#include "capture.h"
+
+typedef struct Replay {
+    Cache       cache;
+    bool        caching;
+    EvalContext eval;
+    char       *scratch; // null-terminated copy of the expression being compiled
+    size_t      scratch_size;
+    size_t      requests, errors;
+} Replay;
+
+// compiles or looks up the expression and evaluates it, false on any error
+bool replay_request(Replay *replay, const uint8_t *body, size_t n) {
+    Bindings vars;
+    const char *text;
+    size_t length;
+    Program compiled = { 0 };
+    volatile bool owned = false; // read after a longjmp
+
+    jmp_buf jump;
+    if(setjmp(jump)) {
+        die_jump = NULL;
+        if(owned) program_free(&compiled);
+        return false;
+    }
+    die_jump = &jump;
+
+    if(!parse_eval(body, n, &vars, &text, &length)) die("Malformed request.\n");
+    Program *program = replay->caching ? cache_get(&replay->cache, text, length) : NULL;
+    if(!program) {
+        if(replay->scratch_size < length + 1) {
+            replay->scratch_size = length + 1;
+            replay->scratch = realloc(replay->scratch, replay->scratch_size);
+        }
+        memcpy(replay->scratch, text, length);
+        replay->scratch[length] = 0;
+        program_compile_text(&compiled, replay->scratch);
+        owned = !replay->caching;
+        program = replay->caching ? cache_put(&replay->cache, text, length, &compiled) : &compiled;
+    }
+    program_check_bindings(program, vars.bound);
+    volatile long long result = program_run(program, &replay->eval, vars.values);
+    (void)result;
+    die_jump = NULL;
+
+    if(owned) program_free(&compiled);
+    return true;
+}
+
+// sleeps until shortly before the time, then spins the rest of the way
+void wait_until(double due) {
+    double now = bulk_now();
+    if(due - now > 200e-6) {
+        double sleep = due - now - 100e-6;
+        struct timespec ts = { (time_t)sleep, (long)((sleep - (time_t)sleep) * 1e9) };
+        nanosleep(&ts, NULL);
+    }
+    while(bulk_now() < due);
+}
+
+int main(int argc, char** argv) {
+    const char *usage = "Usage: %s [-x <speed>] [-l <loops>] [-c <cache entries>] [-f <shunting | pratt>] [-O]\n"
+                        "          [-d <decimal places>] [-r <rounding>] [-m <odd modulus>]\n"
+                        "          [-S <all | profile file>] [-L] <capture file>\n"
+                        "-x 1 replays at the captured speed, -x 2 twice as fast and -x 0 as fast as possible\n"
+                        "-c 0 compiles every request, -L adds the latency of the phases of every request\n";
+    double speed = 1;
+    size_t loops = 1, capacity = 4096;
+    bool simplify = false;
+    bool phases = false;
+    char *superinstructions = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "x:l:c:f:Od:r:m:S:L")) != -1) {
+        switch(opt) {
+            case 'x': speed = atof(optarg);          break;
+            case 'l': loops = atol(optarg);          break;
+            case 'c': capacity = atol(optarg);       break;
+            case 'f': front_end_select(optarg);      break;
+            case 'O': program_add_pass(program_simplify, "simplify"); simplify = true; break;
+            case 'd': decimal_mode(atoi(optarg));    break;
+            case 'r': decimal_set_rounding(optarg);  break;
+            case 'm': modular_mode(optarg);          break;
+            case 'S': superinstructions = optarg;    break;
+            case 'L': phases = true; latency_enable(); break;
+            default: die(usage, argv[0]);
+        }
+    }
+    if(optind != argc - 1 || speed < 0 || loops < 1) die(usage, argv[0]);
+    if(superinstructions) superinstructions_enable(superinstructions);
+
+    CaptureReader reader;
+    capture_reader_open(&reader, argv[optind]);
+    Replay replay = { 0 };
+    replay.caching = capacity > 0;
+    if(replay.caching) cache_init(&replay.cache, capacity);
+    eval_context_init(&replay.eval);
+    Histogram *latency = calloc(1, sizeof(*latency));
+
+    // loops follow each other at the captured pace, as if the capture repeated
+    double start = bulk_now(), captured = 0;
+    for(size_t loop = 0; loop < loops; loop++) {
+        capture_reader_rewind(&reader);
+        uint64_t delay;
+        const uint8_t *body;
+        size_t n;
+        while(capture_next(&reader, &delay, &body, &n)) {
+            captured += delay * 1e-9;
+            double due = speed > 0 ? start + captured / speed : bulk_now();
+            if(speed > 0) wait_until(due);
+
+            if(!replay_request(&replay, body, n)) replay.errors++;
+            replay.requests++;
+            histogram_record(latency, (bulk_now() - due) * 1e9);
+        }
+    }
+    double wall = bulk_now() - start;
+
+    if(reader.truncated) fprintf(stderr, "the capture ends in the middle of a request\n");
+    if(reader.header) {
+        time_t started = reader.header->started / 1000000000;
+        char when[64];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&started));
+        printf("capture: started %s, %.3f s of traffic\n", when, captured / loops);
+    }
+    printf("requests: %zu, errors: %zu, %.3f s, %.0f req/s\n", replay.requests, replay.errors, wall,
+        wall > 0 ? replay.requests / wall : 0);
+    if(replay.caching) printf("cache hits: %zu, misses: %zu, evictions: %zu\n", replay.cache.hits, replay.cache.misses, replay.cache.evictions);
+    histogram_print_header(stdout, "latency");
+    histogram_print(stdout, "request", latency);
+    if(phases) latency_print_stats(stdout);
+    if(simplify) simplify_print_stats(stdout);
+    if(superinstructions) superinstructions_print(stdout);
+
+    free(latency);
+    free(replay.scratch);
+    eval_context_free(&replay.eval);
+    if(replay.caching) cache_free(&replay.cache);
+    capture_reader_close(&reader);
+    return 0;
+}
@@ -0,0 +1,539 @@
+// shuntserver.c
+// Long-running evaluation server keeping compiled expressions warm
+//
+// requests for the same expression are coalesced into batches and evaluated together
+// by the columnar evaluator. a batch is evaluated once it is full or its first request
+// has waited for the window; with no window, only the requests that arrived together
+// in one round of the event loop are batched
+
+#include <stdio.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include "shunting.h"
+#include "program.h"
+#include "cache.h"
+#include "batch.h"
+#include "protocol.h"
+#include "simplify.h"
+#include "profile.h"
+#include "superinstructions.h"
+#include "diskcache.h"
+#include "histogram.h"
+#include "capture.h"
+
+#define MAX_EVENTS  64
+#define MAX_BATCHES 64 // open at the same time, each for a different expression
+#define MAX_UNANSWERED 4096 // requests of a connection not yet answered before it stops being read
+#define MAX_UNSENT (1 << 20) // bytes of responses the peer hasn't taken before it stops being read
+
+typedef struct Connection Connection;
+
+// a response waiting for its turn, responses go out in the order of the requests
+typedef struct Slot Slot;
+struct Slot {
+    Slot       *next;
+    Connection *conn;
+    bool        done;
+    uint8_t     status;
+    long long   result;
+    char       *message; // error, or the text answering a stats request
+    uint64_t    arrived; // phase clock when the request arrived
+};
+
+struct Connection {
+    int         fd;      // -1 once closed
+    Buffer      in;      // received, not yet processed
+    Buffer      out;     // responses not yet sent
+    Slot       *head;    // oldest response not yet sent
+    Slot       *tail;
+    size_t      pending; // slots waiting in batches
+    size_t      unanswered; // slots not yet moved to the output
+    bool        dirty;   // has completed slots to send
+    bool        eof;     // the peer stopped sending, closed once everything is answered
+    Connection *next_dirty;
+};
+
+// requests for one program waiting to be evaluated together
+typedef struct Batch {
+    Program   *program;
+    double     opened;            // arrival time of the first request
+    size_t     count;
+    Slot     **slots;
+    long long *values[VARIABLES]; // columns of the variables used by the program
+} Batch;
+
+typedef struct Server {
+    int         epoll;
+    int         listener;
+    Cache       cache;
+    double      window;     // seconds a batch may wait for more requests
+    size_t      batch_size; // maximum requests per batch
+    Batch       batches[MAX_BATCHES];
+    int         nbatches;
+    Connection *dirty;
+    EvalContext eval;
+    DiskCache  *disk;       // compiled programs kept across restarts, or NULL
+    Capture    *capture;    // log of the evaluation requests, or NULL
+    long long  *results;    // batch results
+    char       *scratch;    // null-terminated copy of the expression being compiled
+    size_t      scratch_size;
+    size_t      requests, errors, batches_run, batched;
+} Server;
+
+volatile sig_atomic_t stopping = 0;
+
+void on_signal(int sig) {
+    stopping = 1;
+}
+
+void set_nonblocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+Slot *slot_open(Connection *conn) {
+    Slot *slot = calloc(1, sizeof(*slot));
+    slot->conn = conn;
+    slot->arrived = phase_start();
+    conn->unanswered++;
+    if(conn->tail) conn->tail->next = slot;
+    else conn->head = slot;
+    conn->tail = slot;
+    return slot;
+}
+
+void slot_complete(Server *server, Slot *slot) {
+    slot->done = true;
+    phase_mark(PHASE_REQUEST, slot->arrived);
+    if(!slot->conn->dirty) {
+        slot->conn->dirty = true;
+        slot->conn->next_dirty = server->dirty;
+        server->dirty = slot->conn;
+    }
+}
+
+void slot_result(Server *server, Slot *slot, long long result) {
+    slot->status = RESPONSE_OK;
+    slot->result = result;
+    slot_complete(server, slot);
+}
+
+// fails the slot with the message of the last die()
+void slot_error(Server *server, Slot *slot) {
+    size_t n = strlen(die_message);
+    if(n && die_message[n - 1] == '\n') n--;
+    slot->status = RESPONSE_ERROR;
+    slot->message = strndup(die_message, n);
+    slot_complete(server, slot);
+    server->errors++;
+}
+
+// evaluates every request in the batch at once and hands out the results.
+// if any row fails, the rows are evaluated one by one so only the failing requests get an error
+void batch_run(Server *server, Batch *batch) {
+    Program *program = batch->program;
+    Columns columns;
+    columns_init(&columns, batch->count);
+    columns.bound = program->vars;
+    for(int v = 0; v < VARIABLES; v++) columns.values[v] = batch->values[v];
+
+    jmp_buf jump;
+    die_jump = &jump;
+    if(!setjmp(jump)) {
+        program_run_rows(program, &server->eval, &columns, 0, batch->count, server->results);
+        for(size_t i = 0; i < batch->count; i++) slot_result(server, batch->slots[i], server->results[i]);
+    } else {
+        // i is live across the jumps back to the setjmp below
+        for(volatile size_t i = 0; i < batch->count; i++) {
+            long long vars[VARIABLES];
+            for(int v = 0; v < VARIABLES; v++) if(program->vars & 1u << v) vars[v] = batch->values[v][i];
+
+            if(!setjmp(jump)) slot_result(server, batch->slots[i], program_run(program, &server->eval, vars));
+            else slot_error(server, batch->slots[i]);
+        }
+    }
+    die_jump = NULL;
+
+    for(size_t i = 0; i < batch->count; i++) batch->slots[i]->conn->pending--;
+    server->batches_run++;
+    server->batched += batch->count;
+    batch->count = 0;
+}
+
+// runs the batches that are full or whose window has passed, or all of them
+void run_batches(Server *server, bool all) {
+    double now = bulk_now();
+    for(int b = 0; b < server->nbatches;) {
+        Batch *batch = &server->batches[b];
+        if(all || batch->count == server->batch_size || now - batch->opened >= server->window) {
+            batch_run(server, batch);
+            cache_unpin(batch->program);
+
+            // keep the open batches packed at the front, reusing the buffers of the closed one
+            Batch closed = *batch;
+            *batch = server->batches[--server->nbatches];
+            server->batches[server->nbatches] = closed;
+        } else {
+            b++;
+        }
+    }
+}
+
+// adds the request to the open batch for its program or opens a new one
+void batch_add(Server *server, Program *program, Bindings *vars, Slot *slot) {
+    Batch *batch = NULL;
+    for(int b = 0; b < server->nbatches && !batch; b++) {
+        if(server->batches[b].program == program) batch = &server->batches[b];
+    }
+    if(!batch) {
+        if(server->nbatches == MAX_BATCHES) run_batches(server, true);
+        batch = &server->batches[server->nbatches++];
+        batch->program = program;
+        cache_pin(program); // caching other programs can't evict it while the batch waits
+        batch->opened = bulk_now();
+        batch->count = 0;
+        if(!batch->slots) batch->slots = malloc(sizeof(*batch->slots) * server->batch_size);
+    }
+
+    for(int v = 0; v < VARIABLES; v++) {
+        if(!(program->vars & 1u << v)) continue;
+        if(!batch->values[v]) batch->values[v] = malloc(sizeof(long long) * server->batch_size);
+        batch->values[v][batch->count] = vars->values[v];
+    }
+    batch->slots[batch->count++] = slot;
+    slot->conn->pending++;
+
+    if(batch->count == server->batch_size) run_batches(server, false);
+}
+
+// looks up or compiles the expression and queues the request for evaluation
+void serve_eval(Server *server, Connection *conn, const uint8_t *body, size_t n) {
+    Slot *slot = slot_open(conn);
+    Bindings vars;
+    const char *text;
+    size_t length;
+
+    jmp_buf jump;
+    if(setjmp(jump)) {
+        die_jump = NULL;
+        slot_error(server, slot);
+        return;
+    }
+    die_jump = &jump;
+
+    if(!parse_eval(body, n, &vars, &text, &length)) die("Malformed request.\n");
+
+    Program *program = cache_get(&server->cache, text, length);
+    if(!program) {
+        if(server->scratch_size < length + 1) {
+            server->scratch_size = length + 1;
+            server->scratch = realloc(server->scratch, server->scratch_size);
+        }
+        memcpy(server->scratch, text, length);
+        server->scratch[length] = 0;
+
+        Program compiled;
+        program_compile_cached(&compiled, server->scratch, server->disk);
+        program = cache_put(&server->cache, text, length, &compiled);
+    }
+    program_check_bindings(program, vars.bound);
+    die_jump = NULL;
+
+    batch_add(server, program, &vars, slot);
+}
+
+void server_print_stats(Server *server, FILE *file) {
+    fprintf(file, "requests: %zu, errors: %zu, batches: %zu, average batch: %.1f\n",
+        server->requests, server->errors, server->batches_run,
+        server->batches_run ? (double)server->batched / server->batches_run : 0);
+    fprintf(file, "cache hits: %zu, misses: %zu, evictions: %zu\n",
+        server->cache.hits, server->cache.misses, server->cache.evictions);
+    if(server->disk) disk_cache_print_stats(server->disk, file);
+    if(server->capture) capture_print_stats(server->capture, file);
+    if(phase_recorder) latency_print_stats(file);
+}
+
+// answers with the statistics as text, in order with the connection's other requests
+void serve_stats(Server *server, Connection *conn) {
+    Slot *slot = slot_open(conn);
+    size_t size;
+    FILE *report = open_memstream(&slot->message, &size);
+    server_print_stats(server, report);
+    fclose(report);
+    slot->status = RESPONSE_OK;
+    slot_complete(server, slot);
+}
+
+// handles all complete requests in the input buffer, returns false if the connection should be dropped
+bool serve_requests(Server *server, Connection *conn) {
+    Buffer *in = &conn->in;
+    while(in->end - in->start >= 4) {
+        uint32_t length = get_u32(in->data + in->start);
+        if(length < 1 || length > PROTOCOL_MAX_PAYLOAD) return false;
+        if(in->end - in->start < 4 + length) break;
+
+        uint8_t *payload = in->data + in->start + 4;
+        switch(payload[0]) {
+            case REQUEST_EVAL:
+                if(server->capture) capture_record(server->capture, payload + 1, length - 1);
+                serve_eval(server, conn, payload + 1, length - 1);
+                break;
+
+            case REQUEST_STATS:
+                serve_stats(server, conn);
+                break;
+
+            default: {
+                Slot *slot = slot_open(conn);
+                strcpy(die_message, "Unknown request type.");
+                slot_error(server, slot);
+            }
+        }
+        server->requests++;
+        in->start += 4 + length;
+    }
+    return true;
+}
+
+// true while the connection owes too much to take more requests
+bool connection_full(Connection *conn) {
+    return conn->unanswered >= MAX_UNANSWERED || conn->out.end - conn->out.start >= MAX_UNSENT;
+}
+
+// asks for writability only while there's something left to write, and for readability only
+// while the peer still sends and the connection has room for more requests. a full connection
+// is read again once its responses go out
+void watch_connection(Server *server, Connection *conn) {
+    struct epoll_event ev = { .events = conn->eof || connection_full(conn) ? 0 : EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+    if(conn->out.start < conn->out.end) ev.events |= EPOLLOUT;
+    epoll_ctl(server->epoll, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+// sends as much of the output as the socket takes, returns false on error or once a peer
+// that stopped sending has all its answers
+bool flush_output(Server *server, Connection *conn) {
+    Buffer *out = &conn->out;
+    while(out->start < out->end) {
+        ssize_t n = write(conn->fd, out->data + out->start, out->end - out->start);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && errno == EAGAIN) break;
+        if(n <= 0) return false;
+        out->start += n;
+    }
+    if(conn->eof && !conn->head && out->start == out->end) return false;
+
+    watch_connection(server, conn);
+    return true;
+}
+
+// moves the completed responses at the head of the connection to its output buffer
+void emit_responses(Connection *conn) {
+    while(conn->head && conn->head->done) {
+        Slot *slot = conn->head;
+        if(conn->fd >= 0) {
+            if(slot->message) {
+                buffer_append_message(&conn->out, slot->status, slot->message, strlen(slot->message));
+            } else {
+                uint8_t body[8];
+                put_u64(body, slot->result);
+                buffer_append_message(&conn->out, RESPONSE_OK, body, sizeof(body));
+            }
+        }
+        conn->head = slot->next;
+        if(!conn->head) conn->tail = NULL;
+        conn->unanswered--;
+        free(slot->message);
+        free(slot);
+    }
+}
+
+void free_connection(Connection *conn) {
+    while(conn->head) {
+        Slot *slot = conn->head;
+        conn->head = slot->next;
+        free(slot->message);
+        free(slot);
+    }
+    buffer_free(&conn->in);
+    buffer_free(&conn->out);
+    free(conn);
+}
+
+// closes the socket, the connection itself lives on until no batch refers to it
+void close_connection(Server *server, Connection *conn) {
+    epoll_ctl(server->epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    if(!conn->pending && !conn->dirty) free_connection(conn);
+}
+
+// sends the responses that became ready
+void flush_dirty(Server *server) {
+    while(server->dirty) {
+        Connection *conn = server->dirty;
+        server->dirty = conn->next_dirty;
+        conn->dirty = false;
+
+        emit_responses(conn);
+        if(conn->fd >= 0) {
+            if(!flush_output(server, conn)) close_connection(server, conn);
+        } else if(!conn->pending) {
+            free_connection(conn);
+        }
+    }
+}
+
+void accept_connections(Server *server) {
+    int fd;
+    while((fd = accept(server->listener, NULL, NULL)) >= 0) {
+        set_nonblocking(fd);
+        Connection *conn = calloc(1, sizeof(*conn));
+        conn->fd = fd;
+        buffer_init(&conn->in);
+        buffer_init(&conn->out);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.ptr = conn };
+        epoll_ctl(server->epoll, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// reads and queues what's available until the connection is full, returns false if it's done with
+bool handle_readable(Server *server, Connection *conn) {
+    while(!conn->eof && !connection_full(conn)) {
+        buffer_reserve(&conn->in, 65536);
+        ssize_t n = read(conn->fd, conn->in.data + conn->in.end, conn->in.capacity - conn->in.end);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0 && errno == EAGAIN) break;
+        if(n < 0) return false;
+
+        // whatever arrived before the peer stopped sending is still answered, the connection
+        // stays open for the responses and is closed once the last one is out
+        if(!n) {
+            conn->eof = true;
+            return flush_output(server, conn);
+        }
+        conn->in.end += n;
+        if(!serve_requests(server, conn)) return false;
+    }
+    if(connection_full(conn)) watch_connection(server, conn);
+    return true;
+}
+
+// time until the oldest open batch is due, NULL to wait indefinitely
+struct timespec *next_timeout(Server *server, struct timespec *timeout) {
+    if(!server->nbatches) return NULL;
+    double due = server->batches[0].opened;
+    for(int b = 1; b < server->nbatches; b++) {
+        if(server->batches[b].opened < due) due = server->batches[b].opened;
+    }
+    double wait = due + server->window - bulk_now();
+    if(wait < 0) wait = 0;
+    timeout->tv_sec = wait;
+    timeout->tv_nsec = (wait - timeout->tv_sec) * 1e9;
+    return timeout;
+}
+
+// waits for events with microsecond timeouts, falling back to milliseconds on kernels before 5.11
+int wait_events(Server *server, struct epoll_event *events) {
+    struct timespec ts, *timeout = next_timeout(server, &ts);
+    int n = epoll_pwait2(server->epoll, events, MAX_EVENTS, timeout, NULL);
+    if(n < 0 && errno == ENOSYS) {
+        int ms = timeout ? timeout->tv_sec * 1000 + (timeout->tv_nsec + 999999) / 1000000 : -1;
+        n = epoll_wait(server->epoll, events, MAX_EVENTS, ms);
+    }
+    return n;
+}
+
+int main(int argc, char** argv) {
+    const char *usage = "Usage: %s [-c <cache entries>] [-w <batch window us>] [-b <batch size>]\n"
+                        "          [-f <shunting | pratt>] [-O] [-d <decimal places>] [-r <rounding>]\n"
+                        "          [-m <odd modulus>] [-P <profile file>]\n"
+                        "          [-S <all | profile file>] [-K <program cache directory>] [-L] [-R <capture file>]\n"
+                        "          <unix socket path | tcp port>\n";
+    size_t capacity = 4096;
+    double window = 0;
+    size_t batch_size = 1024;
+    bool simplify = false;
+    char *profile = NULL;
+    char *superinstructions = NULL;
+    char *disk_dir = NULL;
+    char *capture_path = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "c:w:b:f:Od:r:m:P:S:K:LR:")) != -1) {
+        switch(opt) {
+            case 'c': capacity = atol(optarg);       break;
+            case 'w': window = atof(optarg) * 1e-6;  break;
+            case 'b': batch_size = atol(optarg);     break;
+            case 'f': front_end_select(optarg);      break;
+            case 'O': program_add_pass(program_simplify, "simplify"); simplify = true; break;
+            case 'd': decimal_mode(atoi(optarg));     break;
+            case 'r': decimal_set_rounding(optarg);  break;
+            case 'm': modular_mode(optarg);          break;
+            case 'P': profile = optarg; profile_enable(); break;
+            case 'S': superinstructions = optarg;    break;
+            case 'K': disk_dir = optarg;             break;
+            case 'L': latency_enable();              break;
+            case 'R': capture_path = optarg;         break;
+            default: die(usage, argv[0]);
+        }
+    }
+    if(optind != argc - 1 || batch_size < 1) die(usage, argv[0]);
+    if(superinstructions) superinstructions_enable(superinstructions);
+    DiskCache disk;
+    if(disk_dir) disk_cache_open(&disk, disk_dir);
+    const char *address = argv[optind];
+
+    Server server = { 0 };
+    cache_init(&server.cache, capacity);
+    eval_context_init(&server.eval);
+    server.disk = disk_dir ? &disk : NULL;
+    Capture capture;
+    if(capture_path) capture_open(&capture, capture_path);
+    server.capture = capture_path ? &capture : NULL;
+    server.window = window;
+    server.batch_size = batch_size;
+    server.results = malloc(sizeof(*server.results) * batch_size);
+    server.listener = protocol_socket(address, true);
+    set_nonblocking(server.listener);
+
+    server.epoll = epoll_create1(0);
+    if(server.epoll < 0) die("Cannot create epoll instance.\n");
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(server.epoll, EPOLL_CTL_ADD, server.listener, &ev);
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    struct epoll_event events[MAX_EVENTS];
+    while(!stopping) {
+        int n = wait_events(&server, events);
+        for(int i = 0; i < n; i++) {
+            Connection *conn = events[i].data.ptr;
+            if(!conn) {
+                accept_connections(&server);
+                continue;
+            }
+
+            bool alive = true;
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP)) alive = handle_readable(&server, conn);
+            if(alive && events[i].events & EPOLLOUT) alive = flush_output(&server, conn);
+
+            // both directions are shut, so nothing more can be answered
+            if(events[i].events & (EPOLLHUP | EPOLLERR)) alive = false;
+            if(!alive) close_connection(&server, conn);
+        }
+
+        run_batches(&server, server.window <= 0);
+        flush_dirty(&server);
+    }
+
+    server_print_stats(&server, stderr);
+    if(simplify) simplify_print_stats(stderr);
+    if(profile) profile_dump(profile);
+    if(capture_path) capture_close(&capture);
+    if(!address_is_tcp(address)) unlink(address);
+    return 0;
+}
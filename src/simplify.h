@@ -0,0 +1,108 @@
+// simplify.h
+// Algebraic simplification and strength reduction of compiled programs
+//
+// the rules apply while the DAG is built, so they see already simplified operands.
+// results stay exactly those of the unsimplified program, including wrapping overflow:
+// an operand is only dropped if it can't die, and unbound variables still fail
+
+#ifndef _SIMPLIFY_H
+#define _SIMPLIFY_H
+
+#include "dag.h"
+
+typedef enum Rule {
+    RULE_ADD_ZERO,   // x+0, 0+x -> x
+    RULE_SUB_ZERO,   // x-0 -> x
+    RULE_MUL_ONE,    // x*1, 1*x -> x
+    RULE_MUL_ZERO,   // x*0, 0*x -> 0
+    RULE_MUL_SHIFT,  // x*2^k -> x<<k
+    RULE_DOUBLE_NEG, // (-)(-)x -> x
+    RULE_EXP_ZERO,   // x^0 -> 1
+    RULE_EXP_ONE,    // x^1 -> x
+    RULE_EXP_SQUARE, // x^2 -> x*x
+    RULE_COUNT,
+} Rule;
+
+static const char *RULE_NAMES[] = {
+    "x+0", "x-0", "x*1", "x*0", "x*2^k", "(-)(-)x", "x^0", "x^1", "x^2",
+};
+
+unsigned long simplify_fired[RULE_COUNT]; // times each rule fired, updated atomically
+
+void simplify_count(Rule rule) {
+    __atomic_fetch_add(&simplify_fired[rule], 1, __ATOMIC_RELAXED);
+}
+
+bool dag_is_constant(Dag *dag, uint32_t n, long long value) {
+    return dag->nodes[n].op == OP_PUSH && dag->nodes[n].arg == value;
+}
+
+// dag constructor applying the rules before falling back to dag_node
+uint32_t simplify_node(Dag *dag, uint8_t op, long long arg, uint32_t left, uint32_t right) {
+    switch(op) {
+        case OP_ADD:
+            if(dag_is_constant(dag, right, 0)) { simplify_count(RULE_ADD_ZERO); return left; }
+            if(dag_is_constant(dag, left, 0))  { simplify_count(RULE_ADD_ZERO); return right; }
+            break;
+
+        case OP_SUB:
+            if(dag_is_constant(dag, right, 0)) { simplify_count(RULE_SUB_ZERO); return left; }
+            break;
+
+        case OP_MUL:
+            if(dag_is_constant(dag, right, 1)) { simplify_count(RULE_MUL_ONE); return left; }
+            if(dag_is_constant(dag, left, 1))  { simplify_count(RULE_MUL_ONE); return right; }
+            if((dag_is_constant(dag, right, 0) && !dag->nodes[left].fails) ||
+               (dag_is_constant(dag, left, 0) && !dag->nodes[right].fails)) {
+                simplify_count(RULE_MUL_ZERO);
+                return dag_node(dag, OP_PUSH, 0, DAG_NONE, DAG_NONE);
+            }
+
+            // a positive power of two on either side, 2^63 doesn't fit
+            for(int side = 0; side < 2; side++) {
+                DagNode *factor = &dag->nodes[side ? left : right];
+                if(factor->op != OP_PUSH || factor->arg < 2 || factor->arg & (factor->arg - 1)) continue;
+                simplify_count(RULE_MUL_SHIFT);
+                return dag_node(dag, OP_SHL, __builtin_ctzll(factor->arg), side ? right : left, DAG_NONE);
+            }
+            break;
+
+        case OP_NEG:
+            if(dag->nodes[left].op == OP_NEG) { simplify_count(RULE_DOUBLE_NEG); return dag->nodes[left].left; }
+            break;
+
+        // powl is exact for these exponents, long double holds every long long
+        case OP_EXP:
+            if(dag_is_constant(dag, right, 0) && !dag->nodes[left].fails) {
+                simplify_count(RULE_EXP_ZERO);
+                return dag_node(dag, OP_PUSH, 1, DAG_NONE, DAG_NONE);
+            }
+            if(dag_is_constant(dag, right, 1)) { simplify_count(RULE_EXP_ONE); return left; }
+            if(dag_is_constant(dag, right, 2)) {
+                simplify_count(RULE_EXP_SQUARE);
+                return dag_node(dag, OP_SQUARE, 0, left, DAG_NONE);
+            }
+            break;
+    }
+    return dag_node(dag, op, arg, left, right);
+}
+
+// program pass rewriting the program through a simplifying dag
+void program_simplify(Program *program) {
+    Dag dag;
+    dag_init(&dag);
+    dag.build = simplify_node;
+    dag_add_program(&dag, program);
+
+    uint32_t vars = program->vars;
+    program_free(program);
+    dag_emit(&dag, dag.roots[0], program, vars);
+    dag_free(&dag);
+}
+
+void simplify_print_stats(FILE *file) {
+    fprintf(file, "simplify:");
+    for(int r = 0; r < RULE_COUNT; r++) fprintf(file, " %s %lu%s", RULE_NAMES[r], simplify_fired[r], r + 1 < RULE_COUNT ? "," : "\n");
+}
+
+#endif // _SIMPLIFY_H
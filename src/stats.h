@@ -0,0 +1,97 @@
+// stats.h
+// Summaries of repeated benchmark samples and comparisons between two of them
+//
+// samples outside 1.5 interquartile ranges of the quartiles are dropped as outliers, e.g. runs
+// hit by an interrupt. two summaries are compared with Welch's t interval on the difference
+// of their means, which needs neither the same number of samples nor the same spread
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <math.h>
+#include "shunting.h"
+
+typedef struct Summary {
+    size_t n;        // samples kept
+    size_t outliers; // samples dropped
+    double mean;
+    double stddev;
+    double median;
+} Summary;
+
+// relative change from a baseline mean, with the bounds of its 95% confidence interval
+typedef struct Comparison {
+    double change, low, high;
+} Comparison;
+
+int stats_compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// the q quantile of sorted samples, interpolating between neighbours
+double stats_quantile(const double *sorted, size_t n, double q) {
+    double position = q * (n - 1);
+    size_t below = position;
+    if(below + 1 >= n) return sorted[n - 1];
+    return sorted[below] + (position - below) * (sorted[below + 1] - sorted[below]);
+}
+
+// sorts the samples and summarizes those that aren't outliers
+void stats_summarize(double *samples, size_t n, Summary *summary) {
+    qsort(samples, n, sizeof(*samples), stats_compare_doubles);
+    double q1 = stats_quantile(samples, n, 0.25), q3 = stats_quantile(samples, n, 0.75);
+    double low = q1 - 1.5 * (q3 - q1), high = q3 + 1.5 * (q3 - q1);
+
+    double sum = 0, squares = 0;
+    size_t kept = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(samples[i] < low || samples[i] > high) continue;
+        sum += samples[i];
+        kept++;
+    }
+    double mean = sum / kept;
+    for(size_t i = 0; i < n; i++) {
+        if(samples[i] >= low && samples[i] <= high) squares += (samples[i] - mean) * (samples[i] - mean);
+    }
+    summary->n = kept;
+    summary->outliers = n - kept;
+    summary->mean = mean;
+    summary->stddev = kept > 1 ? sqrt(squares / (kept - 1)) : 0;
+    summary->median = stats_quantile(samples, n, 0.5);
+}
+
+// the 97.5% quantile of Student's t distribution, for two-sided 95% intervals
+double stats_t975(double df) {
+    static const double TABLE[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+    };
+    if(df < 1) df = 1;
+    if(df <= 30) return TABLE[(size_t)df - 1];
+
+    // expansion around the normal quantile, plenty accurate past 30 degrees of freedom
+    double z = 1.959964;
+    return z + (z * z * z + z) / (4 * df) + (5 * pow(z, 5) + 16 * z * z * z + 3 * z) / (96 * df * df);
+}
+
+// the change of the mean from base to now, with Welch's interval on the difference of the means
+void stats_compare(const Summary *base, const Summary *now, Comparison *comparison) {
+    double vb = base->stddev * base->stddev / base->n, vn = now->stddev * now->stddev / now->n;
+    double se = sqrt(vb + vn);
+
+    // Welch-Satterthwaite degrees of freedom
+    double df = 1;
+    if(vb + vn > 0) {
+        double denominator = (base->n > 1 ? vb * vb / (base->n - 1) : 0) + (now->n > 1 ? vn * vn / (now->n - 1) : 0);
+        df = denominator > 0 ? (vb + vn) * (vb + vn) / denominator : 1;
+    }
+
+    double difference = now->mean - base->mean, margin = stats_t975(df) * se;
+    comparison->change = difference / base->mean;
+    comparison->low = (difference - margin) / base->mean;
+    comparison->high = (difference + margin) / base->mean;
+}
+
+#endif // _STATS_H
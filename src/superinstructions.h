@@ -0,0 +1,86 @@
+// superinstructions.h
+// Peephole pass replacing common instruction sequences with superinstructions
+//
+// a superinstruction does the work of a leaf or two and the operator using them in one
+// dispatch, and in the batch evaluator in one loop over the block instead of two or three.
+// which ones are used can be chosen from a recorded profile, see profile.h
+
+#ifndef _SUPERINSTRUCTIONS_H
+#define _SUPERINSTRUCTIONS_H
+
+#include "program.h"
+#include "profile.h"
+
+#define SUPERINSTRUCTION_SHARE 0.01 // of all executed instructions a sequence needs to be fused
+
+bool superinstruction_enabled[SUPERINSTRUCTION_COUNT];
+
+// program pass fusing the enabled sequences, the longest first
+void program_superinstructions(Program *program) {
+    size_t length = 0;
+    int depth = 0, max = 0; // fusing a leaf into its operator lowers the depth, so it's counted again
+    for(size_t i = 0; i < program->length;) {
+        const Superinstruction *found = NULL;
+        for(size_t s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+            const Superinstruction *super = &SUPERINSTRUCTIONS[s];
+            if(!superinstruction_enabled[s] || i + super->length > program->length) continue;
+            if(found && found->length >= super->length) continue;
+            if(!memcmp(&program->code[i], super->sequence, super->length)) found = super;
+        }
+
+        if(!found) {
+            program->code[length] = program->code[i];
+            program->args[length] = program->args[i++];
+        } else {
+            program->code[length] = found->op;
+            program->args[length] = found->length == 3 ? program->args[i] | program->args[i + 1] << 8 : program->args[i];
+            i += found->length;
+        }
+        depth += op_stack_effect(program->code[length++]);
+        if(depth > max) max = depth;
+    }
+    program->length = length;
+    program->depth = max;
+}
+
+// enables every superinstruction, or with a profile those whose sequence makes up at least
+// SUPERINSTRUCTION_SHARE of the executed instructions, and adds the pass. call it after
+// adding the other passes, which don't know superinstructions
+void superinstructions_enable(const char *profile_path) {
+    Profile *profile = NULL;
+    unsigned long total = 0;
+    if(strcmp(profile_path, "all")) {
+        profile = calloc(1, sizeof(*profile));
+        profile_load(profile, profile_path);
+        for(int op = 0; op < OP_COUNT; op++) total += profile->ops[op];
+    }
+
+    for(size_t s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+        const uint8_t *sequence = SUPERINSTRUCTIONS[s].sequence;
+        if(!profile) {
+            superinstruction_enabled[s] = true;
+            continue;
+        }
+        unsigned long count = SUPERINSTRUCTIONS[s].length == 2 ? profile->pairs[sequence[0]][sequence[1]] :
+                              profile->triples[sequence[0]][sequence[1]][sequence[2]];
+        superinstruction_enabled[s] = count && count >= total * SUPERINSTRUCTION_SHARE;
+    }
+    free(profile);
+
+    // the name lists the enabled superinstructions, programs differ with them
+    static char name[256] = "superinstructions";
+    for(size_t s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+        if(superinstruction_enabled[s]) snprintf(name + strlen(name), sizeof(name) - strlen(name), " %s", OPCODE_NAMES[SUPERINSTRUCTIONS[s].op]);
+    }
+    program_add_pass(program_superinstructions, name);
+}
+
+void superinstructions_print(FILE *file) {
+    fprintf(file, "superinstructions:");
+    for(size_t s = 0; s < SUPERINSTRUCTION_COUNT; s++) {
+        if(superinstruction_enabled[s]) fprintf(file, " %s", OPCODE_NAMES[SUPERINSTRUCTIONS[s].op]);
+    }
+    fprintf(file, "\n");
+}
+
+#endif // _SUPERINSTRUCTIONS_H